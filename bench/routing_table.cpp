@@ -0,0 +1,222 @@
+// Host benchmark of the end node routing table
+// The table code below is copied from project/final/endnode.cpp (slot
+// lookup, insert with eviction, backward-shift removal); keep it in step when
+// the table changes. It is first checked against a std::map over random
+// insert/remove/lookup operations, then lookup and update are timed with the
+// table filled to ROUTING_TABLE_CAPACITY. Build once per table size, see
+// README.md.
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+
+#ifndef ROUTING_TABLE_SIZE
+#define ROUTING_TABLE_SIZE 16           // slots, must be a power of two
+#endif
+
+#define BROADCAST_ID 0xFE
+#define GATEWAY_ID 0
+#define ROUTE_TIMEOUT 300000
+#define DEBUG_PRINTF(...)
+
+unsigned long fakeNow = 1000;
+unsigned long millis() { return fakeNow; }
+unsigned long routeLifetime(uint8_t) { return ROUTE_TIMEOUT; }
+struct {
+    unsigned long routesEvicted;
+} metrics;
+
+bool isActiveNextHop(uint8_t nodeId);
+void removeRouteSlot(int slot);
+
+// --- copied from endnode.cpp ---
+#define ROUTING_TABLE_CAPACITY (ROUTING_TABLE_SIZE - ROUTING_TABLE_SIZE / 4)  // keeps probes short
+#define ROUTE_SLOT_EMPTY BROADCAST_ID   // never a valid destination
+static_assert((ROUTING_TABLE_SIZE & (ROUTING_TABLE_SIZE - 1)) == 0,
+              "ROUTING_TABLE_SIZE must be a power of two");
+uint8_t rtDestination[ROUTING_TABLE_SIZE];
+uint8_t rtNextHop[ROUTING_TABLE_SIZE];
+uint8_t rtHopCount[ROUTING_TABLE_SIZE];
+float rtPathEtx[ROUTING_TABLE_SIZE];
+unsigned long rtLastUpdate[ROUTING_TABLE_SIZE];
+int8_t rtRssi[ROUTING_TABLE_SIZE];
+float rtSnr[ROUTING_TABLE_SIZE];
+#define ROUTE_ALTERNATIVES 2
+uint8_t rtAltNextHop[ROUTING_TABLE_SIZE][ROUTE_ALTERNATIVES];
+uint8_t rtAltHopCount[ROUTING_TABLE_SIZE][ROUTE_ALTERNATIVES];
+float rtAltPathEtx[ROUTING_TABLE_SIZE][ROUTE_ALTERNATIVES];
+unsigned long rtAltLastUpdate[ROUTING_TABLE_SIZE][ROUTE_ALTERNATIVES];
+uint16_t routingTableSize = 0;
+
+void initRoutingTable() {
+    memset(rtDestination, ROUTE_SLOT_EMPTY, sizeof(rtDestination));
+    routingTableSize = 0;
+}
+
+int findRouteSlot(uint8_t destinationId) {
+    int slot = destinationId & (ROUTING_TABLE_SIZE - 1);
+    for (int probe = 0; probe < ROUTING_TABLE_SIZE; probe++) {
+        if (rtDestination[slot] == destinationId) {
+            return slot;
+        }
+        if (rtDestination[slot] == ROUTE_SLOT_EMPTY) {
+            return -1;
+        }
+        slot = (slot + 1) & (ROUTING_TABLE_SIZE - 1);
+    }
+    return -1;
+}
+
+int insertRouteSlot(uint8_t destinationId, float pathEtx) {
+    if (routingTableSize >= ROUTING_TABLE_CAPACITY) {
+        int victim = -1;
+        for (int i = 0; i < ROUTING_TABLE_SIZE; i++) {
+            if (rtDestination[i] == ROUTE_SLOT_EMPTY) {
+                continue;
+            }
+            if (millis() - rtLastUpdate[i] >= routeLifetime(rtDestination[i])) {
+                victim = i;
+                break;
+            }
+            if (rtDestination[i] == GATEWAY_ID || isActiveNextHop(rtDestination[i])) {
+                continue;
+            }
+            if (victim < 0 || rtPathEtx[i] > rtPathEtx[victim] ||
+                (rtPathEtx[i] == rtPathEtx[victim] && rtLastUpdate[i] < rtLastUpdate[victim])) {
+                victim = i;
+            }
+        }
+        bool victimExpired = victim >= 0 && millis() - rtLastUpdate[victim] >= routeLifetime(rtDestination[victim]);
+        if (victim < 0 || (!victimExpired && rtPathEtx[victim] <= pathEtx)) {
+            DEBUG_PRINTF("Routing table full, Node %d not added\n", destinationId);
+            return -1;
+        }
+        DEBUG_PRINTF("Routing table full, evicting Node %d\n", rtDestination[victim]);
+        removeRouteSlot(victim);
+        metrics.routesEvicted++;
+    }
+
+    int slot = destinationId & (ROUTING_TABLE_SIZE - 1);
+    while (rtDestination[slot] != ROUTE_SLOT_EMPTY) {
+        slot = (slot + 1) & (ROUTING_TABLE_SIZE - 1);
+    }
+    rtDestination[slot] = destinationId;
+    memset(rtAltNextHop[slot], ROUTE_SLOT_EMPTY, sizeof(rtAltNextHop[slot]));
+    routingTableSize++;
+    return slot;
+}
+
+void removeRouteSlot(int slot) {
+    const int mask = ROUTING_TABLE_SIZE - 1;
+    int hole = slot;
+    for (int i = 1; i < ROUTING_TABLE_SIZE; i++) {
+        int next = (slot + i) & mask;
+        if (rtDestination[next] == ROUTE_SLOT_EMPTY) {
+            break;
+        }
+        int home = rtDestination[next] & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            rtDestination[hole] = rtDestination[next];
+            rtNextHop[hole] = rtNextHop[next];
+            rtHopCount[hole] = rtHopCount[next];
+            rtPathEtx[hole] = rtPathEtx[next];
+            rtLastUpdate[hole] = rtLastUpdate[next];
+            rtRssi[hole] = rtRssi[next];
+            rtSnr[hole] = rtSnr[next];
+            memcpy(rtAltNextHop[hole], rtAltNextHop[next], sizeof(rtAltNextHop[hole]));
+            memcpy(rtAltHopCount[hole], rtAltHopCount[next], sizeof(rtAltHopCount[hole]));
+            memcpy(rtAltPathEtx[hole], rtAltPathEtx[next], sizeof(rtAltPathEtx[hole]));
+            memcpy(rtAltLastUpdate[hole], rtAltLastUpdate[next], sizeof(rtAltLastUpdate[hole]));
+            hole = next;
+        }
+    }
+    rtDestination[hole] = ROUTE_SLOT_EMPTY;
+    routingTableSize--;
+}
+
+bool isActiveNextHop(uint8_t nodeId) {
+    for (int i = 0; i < ROUTING_TABLE_SIZE; i++) {
+        if (rtDestination[i] != ROUTE_SLOT_EMPTY && rtDestination[i] != nodeId && rtNextHop[i] == nodeId) {
+            return true;
+        }
+    }
+    return false;
+}
+// --- end of copy ---
+
+// Random inserts and removals over a key range a little wider than the
+// capacity, checking every key against the reference after each step
+static void checkAgainstMap() {
+    const int keys = ROUTING_TABLE_CAPACITY + 8;
+    std::map<int, int> ref;
+    initRoutingTable();
+    srand(1);
+    for (int step = 0; step < 200000; step++) {
+        int id = rand() % keys;
+        if (id == ROUTE_SLOT_EMPTY) {
+            continue;
+        }
+        int slot = findRouteSlot(id);
+        if (rand() % 2 == 0) {
+            if (slot < 0 && (int)ref.size() < ROUTING_TABLE_CAPACITY) {
+                slot = insertRouteSlot(id, 1.0);
+                assert(slot >= 0);
+                rtNextHop[slot] = id;
+                rtLastUpdate[slot] = fakeNow;
+                rtPathEtx[slot] = 1.0;
+                ref[id] = id;
+            }
+        } else if (slot >= 0) {
+            removeRouteSlot(slot);
+            ref.erase(id);
+        }
+        for (int k = 0; k < keys; k++) {
+            if (k == ROUTE_SLOT_EMPTY) {
+                continue;
+            }
+            int found = findRouteSlot(k);
+            assert((found >= 0) == (ref.count(k) > 0));
+            assert(found < 0 || rtNextHop[found] == k);
+        }
+        assert(routingTableSize == ref.size());
+    }
+}
+
+int main() {
+    checkAgainstMap();
+
+    // Fill to capacity with IDs spread over the whole ID space
+    initRoutingTable();
+    for (int i = 0; routingTableSize < ROUTING_TABLE_CAPACITY; i++) {
+        uint8_t id = (i * 37) % 256;
+        if (id == ROUTE_SLOT_EMPTY) {
+            continue;
+        }
+        int slot = insertRouteSlot(id, 1.0);
+        rtLastUpdate[slot] = fakeNow;
+    }
+
+    const int rounds = 2000000;
+    volatile int sink = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        sink += findRouteSlot((r * 37) % 256);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        int slot = findRouteSlot((r * 37) % 256);
+        if (slot >= 0) {
+            rtLastUpdate[slot] = r;
+            rtPathEtx[slot] = 1.5f;
+        }
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    printf("slots=%d entries=%d lookup %.1f ns, update %.1f ns\n", ROUTING_TABLE_SIZE, (int)routingTableSize,
+           std::chrono::duration<double, std::nano>(t1 - t0).count() / rounds,
+           std::chrono::duration<double, std::nano>(t2 - t1).count() / rounds);
+    return 0;
+}
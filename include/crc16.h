@@ -0,0 +1,107 @@
+// CRC-16/MODBUS (poly 0xA001 reflected, init 0xFFFF, no final XOR)
+// Shared by the end node sketches for Modbus RTU frames; works on any buffer,
+// so it can also guard LoRa payloads. CRC16_METHOD picks the implementation:
+//   CRC16_BITWISE  no table, 8 shift/XOR steps per byte
+//   CRC16_TABLE    one 256-entry table, 512 bytes of flash
+//   CRC16_SLICE4   four tables, 2 KB of flash, 4 bytes per step
+// All tables are built at compile time.
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC16_BITWISE 0
+#define CRC16_TABLE 1
+#define CRC16_SLICE4 2
+#ifndef CRC16_METHOD
+#define CRC16_METHOD CRC16_TABLE
+#endif
+
+#define CRC16_INIT 0xFFFF
+
+// C++11 constexpr: one expression per function, loops become recursion
+constexpr uint16_t crc16Shift(uint16_t crc, int bits) {
+    return bits == 0 ? crc : crc16Shift((crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1, bits - 1);
+}
+constexpr uint16_t crc16Entry(int slice, uint16_t index) {
+    // Slice k is slice k-1 advanced by one zero byte
+    return slice == 0 ? crc16Shift(index, 8)
+                      : (crc16Entry(slice - 1, index) >> 8) ^ crc16Shift(crc16Entry(slice - 1, index) & 0xFF, 8);
+}
+constexpr uint16_t crc16Const(const char* data, size_t len, uint16_t crc = CRC16_INIT) {
+    return len == 0 ? crc : crc16Const(data + 1, len - 1, crc16Shift(crc ^ (uint8_t)*data, 8));
+}
+
+#define CRC16_E4(s, n) crc16Entry(s, n), crc16Entry(s, n + 1), crc16Entry(s, n + 2), crc16Entry(s, n + 3)
+#define CRC16_E16(s, n) CRC16_E4(s, n), CRC16_E4(s, n + 4), CRC16_E4(s, n + 8), CRC16_E4(s, n + 12)
+#define CRC16_E64(s, n) CRC16_E16(s, n), CRC16_E16(s, n + 16), CRC16_E16(s, n + 32), CRC16_E16(s, n + 48)
+#define CRC16_E256(s) CRC16_E64(s, 0), CRC16_E64(s, 64), CRC16_E64(s, 128), CRC16_E64(s, 192)
+
+#if CRC16_METHOD == CRC16_TABLE
+static constexpr uint16_t crc16Table[1][256] = {{CRC16_E256(0)}};
+#elif CRC16_METHOD == CRC16_SLICE4
+static constexpr uint16_t crc16Table[4][256] = {
+    {CRC16_E256(0)}, {CRC16_E256(1)}, {CRC16_E256(2)}, {CRC16_E256(3)}
+};
+static_assert(crc16Table[3][1] == crc16Entry(3, 1), "CRC16 slice table");
+#endif
+
+// Standard check value: CRC of "123456789"
+static_assert(crc16Const("123456789", 9) == 0x4B37, "CRC16/MODBUS check value");
+static_assert(crc16Entry(0, 1) == 0xC0C1 && crc16Entry(0, 255) == 0x4040, "CRC16/MODBUS table");
+
+inline uint16_t crc16ModbusBitwise(const uint8_t* data, size_t len, uint16_t crc = CRC16_INIT) {
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (uint8_t j = 0; j < 8; j++) {
+            crc = (crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+#if CRC16_METHOD != CRC16_BITWISE
+inline uint16_t crc16ModbusTable(const uint8_t* data, size_t len, uint16_t crc = CRC16_INIT) {
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+#endif
+
+#if CRC16_METHOD == CRC16_SLICE4
+inline uint16_t crc16ModbusSlice4(const uint8_t* data, size_t len, uint16_t crc = CRC16_INIT) {
+    // The 16-bit register is consumed by the first two bytes of each group,
+    // so those go through slices 3 and 2 and the last two through 1 and 0
+    while (len >= 4) {
+        crc ^= data[0] | (data[1] << 8);
+        crc = crc16Table[3][crc & 0xFF] ^ crc16Table[2][crc >> 8] ^
+              crc16Table[1][data[2]] ^ crc16Table[0][data[3]];
+        data += 4;
+        len -= 4;
+    }
+    return crc16ModbusTable(data, len, crc);
+}
+#endif
+
+inline uint16_t crc16Modbus(const uint8_t* data, size_t len, uint16_t crc = CRC16_INIT) {
+#if CRC16_METHOD == CRC16_SLICE4
+    return crc16ModbusSlice4(data, len, crc);
+#elif CRC16_METHOD == CRC16_TABLE
+    return crc16ModbusTable(data, len, crc);
+#else
+    return crc16ModbusBitwise(data, len, crc);
+#endif
+}
+
+// True if the last two bytes of frame hold the CRC of the rest, LSB first
+inline bool crc16ModbusCheck(const uint8_t* frame, size_t len) {
+    if (len < 2) {
+        return false;
+    }
+    uint16_t crc = crc16Modbus(frame, len - 2);
+    return frame[len - 2] == (crc & 0xFF) && frame[len - 1] == (crc >> 8);
+}
+
+#endif
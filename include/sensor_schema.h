@@ -0,0 +1,100 @@
+// Sensor payload schema
+// The one list of reported values, shared by the end node and the gateway.
+// Each entry is a "<key>:<value>" field of the DATA payload, in this order,
+// with the value clamped to the field's range and printed to a fixed number of
+// decimals, so SENSOR_PAYLOAD_MAX bounds the encoded length. The node encodes
+// its readings from it; the gateway decodes, logs and maps them to datastreams
+// from it. Adding a sensor is one SensorId and one entry here, plus its read
+// function, filter and exception channel on the node; static_asserts on both
+// sides catch a list that was not extended.
+#ifndef SENSOR_SCHEMA_H
+#define SENSOR_SCHEMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum SensorId {
+    SENSOR_RAIN,
+    SENSOR_DISTANCE,
+    SENSOR_COUNT
+};
+
+struct SensorField {
+    char key;                   // payload tag, H, V and Q are taken
+    const char* name;           // log column
+    const char* unit;
+    uint8_t decimals;           // digits after the point on the wire
+    float minValue;             // range on the wire, readings are clamped to it,
+    float maxValue;             // exact at decimals (no rounding up a digit)
+};
+
+constexpr SensorField sensorFields[] = {
+    {'R', "Rain", "mm", 2, 0.0, 65535.0},          // U16 Modbus register
+    {'D', "Distance", "cm", 2, 0.0, 6553.5},       // U16 frame in mm
+};
+
+// C++11 constexpr: one expression per function, loops become recursion
+constexpr bool sensorKeyFree(char key, size_t end, size_t i = 0) {
+    return i == end ? key != 'H' && key != 'V' && key != 'Q'
+                    : sensorFields[i].key != key && sensorKeyFree(key, end, i + 1);
+}
+constexpr bool sensorKeysUnique(size_t i = 0) {
+    return i == SENSOR_COUNT || (sensorKeyFree(sensorFields[i].key, i) && sensorKeysUnique(i + 1));
+}
+
+// Longest "<key>:<value>" of field i, and of all fields with their commas
+constexpr size_t sensorDigits(unsigned long value) {
+    return value < 10 ? 1 : 1 + sensorDigits(value / 10);
+}
+constexpr float sensorMagnitude(size_t i) {
+    return -sensorFields[i].minValue > sensorFields[i].maxValue ? -sensorFields[i].minValue : sensorFields[i].maxValue;
+}
+constexpr size_t sensorFieldMax(size_t i) {
+    return 2 + (sensorFields[i].minValue < 0 ? 1 : 0) + sensorDigits((unsigned long)sensorMagnitude(i)) +
+           (sensorFields[i].decimals ? 1 + sensorFields[i].decimals : 0);
+}
+constexpr size_t sensorPayloadMax(size_t i = 0) {
+    return i == SENSOR_COUNT ? 0 : (i ? 1 : 0) + sensorFieldMax(i) + sensorPayloadMax(i + 1);
+}
+#define SENSOR_PAYLOAD_MAX sensorPayloadMax()
+
+static_assert(sizeof(sensorFields) / sizeof(sensorFields[0]) == SENSOR_COUNT, "one sensorFields entry per SensorId");
+static_assert(sensorKeysUnique(), "sensor payload keys must be unique and not H, V or Q");
+static_assert(SENSOR_COUNT <= 16, "Q holds 2 quality bits per sensor in 32 bits");
+
+// Writes the sensor fields, comma separated. Returns the length written, or
+// -1 if they did not fit (payload is still terminated).
+inline int encodeSensors(char* payload, size_t length, const float* values) {
+    size_t written = 0;
+    for (size_t i = 0; i < SENSOR_COUNT; i++) {
+        float value = values[i] < sensorFields[i].minValue ? sensorFields[i].minValue
+                    : values[i] > sensorFields[i].maxValue ? sensorFields[i].maxValue : values[i];
+        int n = snprintf(payload + written, length - written, "%s%c:%.*f", i ? "," : "",
+                         sensorFields[i].key, sensorFields[i].decimals, value);
+        if (n < 0 || written + n >= length) {
+            return -1;
+        }
+        written += n;
+    }
+    return written;
+}
+
+// Fills values[] from the fields found in payload and returns them as a bit
+// mask; missing fields are left untouched
+inline uint32_t decodeSensors(const char* payload, float* values) {
+    uint32_t found = 0;
+    for (size_t i = 0; i < SENSOR_COUNT; i++) {
+        const char tag[3] = {sensorFields[i].key, ':', '\0'};
+        const char* ptr = strstr(payload, tag);
+        if (ptr) {
+            values[i] = atof(ptr + 2);
+            found |= 1UL << i;
+        }
+    }
+    return found;
+}
+
+#endif
@@ -12,6 +12,7 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/semphr.h>
+#include "crc16.h"
 
 // Debug configuration
 #define DEBUG_MODE true           
@@ -43,25 +44,9 @@ const int CS = 5;
 SoftwareSerial mySerial(16, 17);
 SoftwareSerial mySerial1(35, 34);
 // Prototypes declaration functions
-uint16_t calculateCRC(uint8_t *data, uint8_t len);
 unsigned char data[4] = {};
 float rain_val;
 float distance_val;
-uint16_t calculateCRC(uint8_t *data, uint8_t len) {
-    uint16_t crc = 0xFFFF;
-    for (uint8_t i = 0; i < len; i++) {
-      crc ^= data[i];
-      for (uint8_t j = 0; j < 8; j++) {
-        if (crc & 0x0001) {
-          crc >>= 1;
-          crc ^= 0xA001;
-        } else {
-          crc >>= 1;
-        }
-      }
-    }
-    return crc;
-}
 // ===================================================
 // End of existing setup
 // Pin definitions LoRa
@@ -614,7 +599,7 @@ void bacaRain() {
     uint8_t id = 1; // Ubah tipe data menjadi uint8_t
     // Kirim permintaan baca data ke RS485
     uint8_t buffer[] = { id, 0x03, 0x01, 0x05, 0x00, 0x01, 0x00, 0x00 };
-    uint16_t crc = calculateCRC(buffer, sizeof(buffer) - 2);
+    uint16_t crc = crc16Modbus(buffer, sizeof(buffer) - 2);
     buffer[sizeof(buffer) - 2] = crc & 0xFF;  // LSB
     buffer[sizeof(buffer) - 1] = crc >> 8;    // MSB
     // Kirim permintaan ke RS485
@@ -628,7 +613,8 @@ void bacaRain() {
             // Membaca 8 byte dari RS485
             mySerial.readBytes(responseHeader, 8);
             // Jika balasan sesuai (misal, id dan kode fungsi benar)
-            if (responseHeader[0] == id && responseHeader[1] == 0x03 && responseHeader[2] == 0x02) {
+            if (responseHeader[0] == id && responseHeader[1] == 0x03 && responseHeader[2] == 0x02 &&
+                crc16ModbusCheck(responseHeader, 7)) {
                 // Gabungkan byte 3 dan byte 4 menjadi satu nilai 16-bit
                 uint16_t rawValue = (responseHeader[3] << 8) | responseHeader[4];
                 // Simpan nilai rawValue sebagai int (tidak perlu pembagian karena ingin hasil integer)
@@ -9,6 +9,7 @@
 #include <DS3231-RTC.h>
 #include <FastLED.h>
 #include <Arduino.h>
+#include "crc16.h"
 
 // Debug configuration
 #define DEBUG_MODE true           
@@ -47,27 +48,10 @@ SoftwareSerial mySerial(16, 17);
 SoftwareSerial mySerial1(35, 34);
 
 // Prototypes declaration functions
-uint16_t calculateCRC(uint8_t *data, uint8_t len);
 unsigned char data[4] = {};
 float rain_val;
 float distance_val;
 
-uint16_t calculateCRC(uint8_t *data, uint8_t len) {
-    uint16_t crc = 0xFFFF;
-    for (uint8_t i = 0; i < len; i++) {
-      crc ^= data[i];
-      for (uint8_t j = 0; j < 8; j++) {
-        if (crc & 0x0001) {
-          crc >>= 1;
-          crc ^= 0xA001;
-        } else {
-          crc >>= 1;
-        }
-      }
-    }
-    return crc;
-  }
-
 // ===================================================
 // End of existing setup
 
@@ -638,7 +622,7 @@ void bacaRain() {
 
   // Kirim permintaan baca data ke RS485
   uint8_t buffer[] = { id, 0x03, 0x01, 0x05, 0x00, 0x01, 0x00, 0x00 };
-  uint16_t crc = calculateCRC(buffer, sizeof(buffer) - 2);
+  uint16_t crc = crc16Modbus(buffer, sizeof(buffer) - 2);
   buffer[sizeof(buffer) - 2] = crc & 0xFF;  // LSB
   buffer[sizeof(buffer) - 1] = crc >> 8;    // MSB
 
@@ -666,7 +650,8 @@ void bacaRain() {
       }
 
       // Jika balasan sesuai (misal, id dan kode fungsi benar)
-      if (responseHeader[0] == id && responseHeader[1] == 0x03 && responseHeader[2] == 0x02) {
+      if (responseHeader[0] == id && responseHeader[1] == 0x03 && responseHeader[2] == 0x02 &&
+          crc16ModbusCheck(responseHeader, 7)) {
         // Gabungkan byte 3 dan byte 4 menjadi satu nilai 16-bit
         uint16_t rawValue = (responseHeader[3] << 8) | responseHeader[4];
 
@@ -8,7 +8,12 @@
 #include <Wire.h>
 #include <DS3231-RTC.h>
 #include <FastLED.h>
+#include <Preferences.h>
+#include <mbedtls/md.h>
+#include <esp_sleep.h>
 #include <Arduino.h>
+#include "crc16.h"
+#include "sensor_schema.h"
 
 // Debug configuration
 #define DEBUG_MODE true           
@@ -32,31 +37,170 @@ RTClib myRTC;
 // SD Card
 const int CS = 5;
 
-// Software Serial
-SoftwareSerial mySerial(16, 17);
-SoftwareSerial mySerial1(35, 34);
-
-// Prototypes declaration functions
-uint16_t calculateCRC(uint8_t *data, uint8_t len);
-unsigned char data[4] = {};
-float rain_val;
-float distance_val;
-
-uint16_t calculateCRC(uint8_t *data, uint8_t len) {
-    uint16_t crc = 0xFFFF;
-    for (uint8_t i = 0; i < len; i++) {
-      crc ^= data[i];
-      for (uint8_t j = 0; j < 8; j++) {
-        if (crc & 0x0001) {
-          crc >>= 1;
-          crc ^= 0xA001;
-        } else {
-          crc >>= 1;
-        }
-      }
-    }
-    return crc;
-  }
+// Sensor buses
+// Each bus runs on an ESP32 hardware UART: the driver's RX FIFO interrupt
+// moves bytes into a ring buffer, so no byte is bit-banged with interrupts
+// masked while DIO0 is waiting. UART0 is the debug console, which leaves
+// UART1 and UART2; a bus set to SENSOR_UART_SOFTWARE falls back to
+// SoftwareSerial on the same pins. Either way the bus is used as a Stream.
+#define SENSOR_UART_SOFTWARE -1
+#define MODBUS_UART 2
+#define MODBUS_RX_PIN 16
+#define MODBUS_TX_PIN 17
+#define DISTANCE_UART 1
+#define DISTANCE_RX_PIN 35
+#define DISTANCE_TX_PIN -1              // listen only, GPIO34 cannot drive
+#define POWER_METER_UART SENSOR_UART_SOFTWARE
+#define POWER_METER_RX_PIN 14
+#define POWER_METER_TX_PIN 0
+#define POWER_METER_BAUD 115200
+#define SENSOR_RX_BUFFER 256            // driver ring buffer, bytes
+SoftwareSerial mySerial(MODBUS_RX_PIN, MODBUS_TX_PIN);
+SoftwareSerial mySerial1(DISTANCE_RX_PIN, DISTANCE_TX_PIN);
+SoftwareSerial mySerial2(POWER_METER_RX_PIN, POWER_METER_TX_PIN);
+Stream* modbusBus = &mySerial;
+Stream* distanceBus = &mySerial1;
+Stream* meterBus = &mySerial2;
+
+// Sensor bus profile
+// SERIAL_PROFILE measures what the buses cost the radio, to compare the
+// hardware UARTs with the SoftwareSerial fallback on the same board. A
+// hardware timer fires every PROFILE_PERIOD us and restarts its count at the
+// alarm, so the count read in its ISR is the interrupt latency (plus a fixed
+// dispatch cost); whatever masks interrupts delays DIO0 just as much. CPU
+// load is how much longer a fixed busy loop in loop() takes than its fastest,
+// uninterrupted run: the share of this core taken by interrupt handlers and
+// driver tasks.
+#define SERIAL_PROFILE false
+#define PROFILE_TIMER 0
+#define PROFILE_PERIOD 1000             // us
+#define PROFILE_SPIN 1000               // busy loop iterations
+struct SerialProfile {
+    volatile uint64_t latencySum;       // us
+    volatile uint32_t latencyMax;
+    volatile uint32_t interrupts;
+    uint64_t spinCycles;
+    uint32_t spinMin;
+    unsigned long spins;
+};
+SerialProfile serialProfile = {};
+hw_timer_t* profileTimer = NULL;
+
+// Sensor readings, indexed by SensorId (sensor_schema.h)
+float sensorValues[SENSOR_COUNT];
+
+// Ultrasonic distance sensor (distanceBus)
+// The sensor streams 4-byte frames: 0xFF, distance high, distance low (mm)
+// and the low byte of the sum of the first three. parseDistance() consumes
+// whatever has arrived, one byte at a time, resynchronising on 0xFF after a
+// bad checksum, and keeps the latest good reading.
+#define DISTANCE_HEADER 0xFF
+#define DISTANCE_MAX_AGE 1000           // ms a reading counts as current
+#define DISTANCE_TIMEOUT 2000           // ms to wait for a current reading
+#define DISTANCE_BAUD 9600
+#define DISTANCE_FRAME_SIZE 4           // bytes per RX FIFO interrupt on a hardware UART
+struct DistanceParser {
+    uint8_t frame[4];
+    uint8_t length;
+    float latest;                   // cm
+    unsigned long updatedAt;
+    bool valid;
+    unsigned long framesValid;
+    unsigned long framesInvalid;
+};
+DistanceParser distanceParser = {};
+bool samplePending = false;
+
+// Modbus RTU master (rain sensor on RS485, modbusBus)
+// One transaction at a time, driven by modbusPoll() from loop() so the radio
+// keeps being served while the sensor answers. A response is complete as soon
+// as the expected length has arrived, or after 3.5 character times of
+// silence, and fails after MODBUS_RESPONSE_TIMEOUT. On a hardware UART the
+// silence is detected by the UART's own RX timeout instead of micros().
+#define MODBUS_BAUD 9600
+#define MODBUS_CHAR_US (11UL * 1000000UL / MODBUS_BAUD)  // start, 8 data, parity or 2 stop
+#define MODBUS_T35_US (MODBUS_BAUD > 19200 ? 1750UL : MODBUS_CHAR_US * 7 / 2)
+#define MODBUS_RESPONSE_TIMEOUT 500     // ms
+#define MODBUS_RX_TIMEOUT 4             // character times, t3.5 rounded up
+#define MODBUS_FRAME_SIZE 32
+#define MODBUS_IDLE 0
+#define MODBUS_WAITING 1
+#define MODBUS_DONE 2
+#define MODBUS_FAILED 3
+#define MODBUS_READ_HOLDING 0x03
+#define MODBUS_READ_INPUT 0x04
+
+struct ModbusTransaction {
+    uint8_t state;
+    uint8_t slaveId;
+    uint8_t function;
+    uint8_t expectedLength;
+    uint8_t response[MODBUS_FRAME_SIZE];
+    uint8_t length;
+    unsigned long startTime;        // millis()
+    unsigned long lastByteTime;     // micros()
+};
+ModbusTransaction modbus = {MODBUS_IDLE};
+volatile bool modbusRxIdle = false;     // set by the UART event task
+
+// Modbus poll table
+// One entry per value. At boot, entries of the same slave and function whose
+// registers are at most MODBUS_MERGE_GAP apart are merged into one read
+// block. The scheduler runs one block at a time, preferring a different slave
+// than the last one, and decodes each reply into modbusSamples[]. period 0
+// means the point is only read when a sample is taken (modbusRefresh()).
+#define MODBUS_U16 0
+#define MODBUS_S16 1
+#define MODBUS_U32 2                    // high word first
+#define MODBUS_F32 3                    // IEEE 754, high word first
+#define MODBUS_TYPE_REGISTERS(type) ((type) >= MODBUS_U32 ? 2 : 1)
+#define MODBUS_MERGE_GAP 4              // unused registers worth reading to save a transaction
+#define MODBUS_MAX_REGISTERS ((MODBUS_FRAME_SIZE - 5) / 2)
+#define RAIN_SENSOR_ID 1
+#define RAIN_REGISTER 0x0105
+
+struct ModbusPoint {
+    uint8_t slaveId;
+    uint8_t function;
+    uint16_t startRegister;
+    uint8_t type;                   // MODBUS_U16..MODBUS_F32, sets the register count
+    float scale;
+    unsigned long period;           // ms, 0 = only with each sample
+};
+
+#define RAIN_POINT 0
+const ModbusPoint modbusPoints[] = {
+    {RAIN_SENSOR_ID, MODBUS_READ_HOLDING, RAIN_REGISTER, MODBUS_U16, 1.0, 0},
+    // More instruments on the same bus, e.g.
+    // {2, MODBUS_READ_INPUT, 0x0000, MODBUS_F32, 1.0, 60000},  // water level
+    // {2, MODBUS_READ_INPUT, 0x0002, MODBUS_S16, 0.1, 60000},  // water temperature
+};
+#define MODBUS_POINT_COUNT (sizeof(modbusPoints) / sizeof(modbusPoints[0]))
+
+struct ModbusBlock {
+    uint8_t slaveId;
+    uint8_t function;
+    uint16_t startRegister;
+    uint8_t count;
+    unsigned long period;           // shortest non-zero period of its points
+    unsigned long lastPoll;
+    bool refresh;
+};
+ModbusBlock modbusBlocks[MODBUS_POINT_COUNT];
+uint8_t modbusBlockCount = 0;
+uint8_t modbusPointBlock[MODBUS_POINT_COUNT];
+int modbusActiveBlock = -1;
+uint8_t modbusLastSlave = 0;
+unsigned long modbusBusFreeAt = 0;  // micros()
+
+// Latest decoded value per poll table entry
+struct ModbusSample {
+    float value;
+    unsigned long updatedAt;
+    unsigned long failures;
+    bool valid;
+};
+ModbusSample modbusSamples[MODBUS_POINT_COUNT] = {};
 
 // ===================================================
 // End of existing setup
@@ -91,24 +235,343 @@ uint16_t calculateCRC(uint8_t *data, uint8_t len) {
 
 // Node configuration
 #define NODE_ID 2           // Set for end node
-#define GATEWAY_ID 0      // Set for gateway       
+// Gateways: both answer the anycast address, so uplinks go to whichever is
+// best reachable and either one ACKs. Node ID 253 is reserved for it.
+#define GATEWAY_PRIMARY_ID 0      // devkit gateway (node-id-0)
+#define GATEWAY_SECONDARY_ID 255  // TTGO gateway (node-id-255)
+#define GATEWAY_ID 0xFD           // anycast uplink destination
+#define IS_GATEWAY(id) ((id) == GATEWAY_PRIMARY_ID || (id) == GATEWAY_SECONDARY_ID)
 #define MAX_HOPS 3         
 #define RETRY_COUNT 3      
+#define FAILOVER_MISSED_ACKS 2   // missed ACKs before switching to a fallback next hop
+#define BROADCAST_ID 0xFE  // 0xFF is taken by the TTGO gateway (node-id-255)
 
 // Message types
 #define MSG_TYPE_DATA 1
 #define MSG_TYPE_ROUTE_REQUEST 2
 #define MSG_TYPE_ROUTE_RESPONSE 3
 #define MSG_TYPE_ACK 4
+#define MSG_TYPE_BEACON 5
+#define MSG_TYPE_LINK_ACK 6
+#define MSG_TYPE_CONFIG 7
+#define MSG_TYPE_DOWNLINK 8
+
+// Delivery confirmation
+// Every unicast DATA hop is acknowledged by a short LinkAck from the next hop,
+// so a relay is done with a frame once its neighbour has it. The gateway's
+// end-to-end ACK is only sent for frames flagged MSG_FLAG_CONFIRM; the source
+// sets it when E2E_CONFIRM is on and always when it has to flood.
+#define MSG_FLAG_CONFIRM 0x01
+#define MSG_FLAG_DOWNLINK 0x02      // ACK payload carries a DownlinkCommand
+#define MSG_FLAG_DL_PENDING 0x04    // gateway holds more downlinks for us
+#define MSG_FLAG_DL_ACK 0x08        // uplink confirms the last downlink
+// End-to-end retry counter in the upper nibble. The source bumps it each time
+// it resends after a missing end-to-end ACK, and relays key duplicate
+// suppression on it, so a retry is carried along the whole path while a
+// link-level repeat of the same attempt is not forwarded twice.
+#define MSG_FLAG_RETRY_MASK 0xF0
+#define MSG_FLAG_RETRY_STEP 0x10
+#define E2E_CONFIRM false
+// ACK waits are a turnaround margin plus the airtime of the frames that have
+// to come back, so they stretch with the SF set over the air. At SF7 they
+// come to about 500 ms and 5 s, at SF12 to 2.5 s and 17 s.
+#define LINK_ACK_MARGIN 400     // ms
+#define LINK_ACK_TIMEOUT (LINK_ACK_MARGIN + frameAirtime(sizeof(LoRaMessage)))
+// Implicit ACK: a relay that forwards a frame does not link-ACK it, because
+// the previous hop overhears the forward (same source/messageId, hopCount+1).
+// Only the last hop, or a relay that drops the frame, sends a LinkAck.
+#define IMPLICIT_ACK true
+#define E2E_ACK_MARGIN 4500     // ms
+#define E2E_ACK_TIMEOUT (E2E_ACK_MARGIN + 2 * MAX_HOPS * frameAirtime(sizeof(LoRaMessage)))
 
 // Debug timing
 #define DEBUG_INTERVAL 10000  
 unsigned long lastDebugTime = 0;
 
+// Report-by-exception configuration
+// Sensors are sampled every SAMPLE_INTERVAL, but an uplink is only sent when a
+// value leaves its deadband, changes faster than its rate limit, or when the
+// heartbeat is due. The rate is measured over at least the time it takes to
+// cross one deadband at the limit (12 s rain, 24 s distance), so jitter below
+// the deadband never reads as a fast change. Set REPORT_BY_EXCEPTION to false
+// for a fixed 30 s uplink.
+#define REPORT_BY_EXCEPTION true
+#if REPORT_BY_EXCEPTION
+#define SAMPLE_INTERVAL 10000           // 10 seconds
+#else
+#define SAMPLE_INTERVAL 30000           // 30 seconds
+#endif
+#define HEARTBEAT_INTERVAL 300000       // 5 minutes
+#define RAIN_DEADBAND 1.0               // mm
+#define RAIN_RATE_THRESHOLD 5.0         // mm per minute
+#define DISTANCE_DEADBAND 2.0           // cm
+#define DISTANCE_RATE_THRESHOLD 5.0     // cm per minute
+unsigned long lastReportTime = 0;
+bool hasReported = false;
+
+struct ExceptionChannel {
+    float deadband;
+    float rateThreshold;     // change per minute
+    float lastReported;
+    float rateBase;          // sample the rate is measured from
+    unsigned long rateBaseTime;
+    bool hasSample;
+};
+
+ExceptionChannel exceptionChannels[] = {
+    {RAIN_DEADBAND, RAIN_RATE_THRESHOLD, 0, 0, 0, false},           // SENSOR_RAIN
+    {DISTANCE_DEADBAND, DISTANCE_RATE_THRESHOLD, 0, 0, 0, false},   // SENSOR_DISTANCE
+};
+static_assert(sizeof(exceptionChannels) / sizeof(exceptionChannels[0]) == SENSOR_COUNT,
+              "one exception channel per sensor");
+
+// Sensor filtering
+// Each reading passes its channel's filter before it is reported or checked
+// for an exception. A failed read holds the last filtered value and is
+// flagged stale. A jump of more than spikeLimit from the filtered value is
+// rejected and flagged, unless FILTER_SPIKE_CONFIRM readings in a row agree
+// (each within spikeLimit of the first), which is taken as a real step and
+// restarts the filter there. Accepted
+// readings go through a median of the last FILTER_MEDIAN and an EMA. The
+// flags of all channels are sent as Q (hex, 2 bits per sensor in SensorId
+// order), only when one is set so normal reports keep their size.
+#define FILTER_MEDIAN 5                 // readings, 1 disables the median
+#define FILTER_SPIKE_CONFIRM 3
+#define RAIN_EMA_ALPHA 1.0              // 1 = no smoothing
+#define RAIN_SPIKE_LIMIT 20.0           // mm, 0 disables
+#define DISTANCE_EMA_ALPHA 0.5
+#define DISTANCE_SPIKE_LIMIT 50.0       // cm, 0 disables
+#define QUALITY_STALE 0x01              // read failed, value held
+#define QUALITY_SPIKE 0x02              // reading rejected as a spike, value held
+
+struct SensorFilter {
+    float emaAlpha;
+    float spikeLimit;
+    float window[FILTER_MEDIAN];    // ring of accepted readings
+    uint8_t count;
+    uint8_t next;
+    uint8_t spikes;                 // consecutive rejected readings near spikeCandidate
+    float spikeCandidate;           // first of them
+    uint8_t quality;                // QUALITY_* of the last reading
+    float value;
+    unsigned long rejected;
+    unsigned long failed;
+};
+
+SensorFilter sensorFilters[] = {
+    {RAIN_EMA_ALPHA, RAIN_SPIKE_LIMIT},            // SENSOR_RAIN
+    {DISTANCE_EMA_ALPHA, DISTANCE_SPIKE_LIMIT},    // SENSOR_DISTANCE
+};
+static_assert(sizeof(sensorFilters) / sizeof(sensorFilters[0]) == SENSOR_COUNT, "one filter per sensor");
+
+// Read functions, in SensorId order. Each returns false unless it has a
+// reading taken since the given millis()
+typedef bool (*SensorRead)(float& value, unsigned long since);
+bool bacaRain(float& value, unsigned long since);
+bool bacaDistance(float& value, unsigned long since);
+const SensorRead sensorReads[] = {
+    bacaRain,                                       // SENSOR_RAIN
+    bacaDistance,                                   // SENSOR_DISTANCE
+};
+static_assert(sizeof(sensorReads) / sizeof(sensorReads[0]) == SENSOR_COUNT, "one read function per sensor");
+
+// Over-the-air configuration
+// The gateway floods signed MSG_TYPE_CONFIG frames; destinationId is one node
+// or BROADCAST_ID for all. A newer version is kept in NVS and switched to at
+// applyAt (RTC unix time, 0 = at once) so the whole network changes SF
+// together; a change of SF or TX power without applyAt is rejected. The
+// defines above are the version 0 defaults, and the active version is
+// reported in telemetry as V. After a radio change the previous config is
+// kept in NVS until any frame is heard; if none arrives within
+// CONFIG_FALLBACK_TIME of applyAt the node goes back to it.
+// The HMAC key is shared with the gateway and never in source: it is read
+// from CONFIG_KEY_FILE on the SD card when present and kept in NVS, so the
+// file can be removed after the first boot. Without a key every config is
+// rejected.
+#define CONFIG_KEY_FILE "/CONFIGKEY.txt"
+#define CONFIG_KEY_MAX 64
+#define CONFIG_SIGNATURE_SIZE 8
+#define CONFIG_CHECK_INTERVAL 1000      // ms between RTC reads for applyAt
+#define CONFIG_FALLBACK_TIME 600        // s, at least 3 sample intervals
+struct NetworkConfig {
+    uint16_t version;
+    uint8_t target;                      // node ID or BROADCAST_ID
+    uint8_t spreadingFactor;
+    int8_t txPower;
+    uint32_t applyAt;
+    uint32_t sampleInterval;             // ms
+    uint32_t debugInterval;              // ms
+    uint8_t signature[CONFIG_SIGNATURE_SIZE];   // truncated HMAC-SHA256 of the fields above
+} __attribute__((packed));
+NetworkConfig activeConfig = {0, BROADCAST_ID, SPREADING_FACTOR, TX_POWER, 0, SAMPLE_INTERVAL, DEBUG_INTERVAL, {0}};
+NetworkConfig pendingConfig;
+bool hasPendingConfig = false;
+char configKey[CONFIG_KEY_MAX + 1] = "";
+NetworkConfig fallbackConfig;            // last known good radio settings
+bool fallbackArmed = false;
+unsigned long lastConfigCheck = 0;
+
+// Routing mode
+// ROUTING_ON_DEMAND floods a route request when no route exists (AODV-style).
+// ROUTING_PROACTIVE is for always-on relays: every node beacons its cost to
+// the gateway and picks the lowest-cost neighbour as parent, so no request
+// flood is needed.
+// ROUTING_CONVERGECAST is for many-to-one traffic: the gateway roots a rank
+// gradient (path ETX) advertised with trickle-paced beacons, and data is sent
+// upward to any neighbour of lower rank (RPL DODAG-style).
+// Gateway and nodes must use the same mode.
+#define ROUTING_ON_DEMAND 0
+#define ROUTING_PROACTIVE 1
+#define ROUTING_CONVERGECAST 2
+#define ROUTING_MODE ROUTING_ON_DEMAND
+
 // Route discovery timing
 #define ROUTE_DISCOVERY_INTERVAL 60000  // 60 seconds
+#define ROUTE_TIMEOUT 300000            // 5 minutes
 unsigned long lastRouteDiscovery = 0;
-bool hasValidRoute = false;
+
+// Route request flooding
+// A relay holds each new route request for a random assessment delay and
+// counts the copies its neighbours rebroadcast meanwhile. If it heard
+// RREQ_COPY_THRESHOLD copies, its own rebroadcast adds little coverage and
+// is cancelled.
+#define RREQ_ASSESSMENT_DELAY 500       // ms, upper bound of the random delay
+#define RREQ_COPY_THRESHOLD 3
+#define RREQ_PENDING_SLOTS 2
+
+// Beacon timing (proactive mode)
+#define BEACON_INTERVAL 30000           // 30 seconds
+#define BEACON_JITTER 3000              // up to 3 seconds
+#define PARENT_TIMEOUT (3 * BEACON_INTERVAL)
+#define ROUTE_COST_INFINITE 0xFF
+
+// Trickle timing (convergecast mode)
+// The beacon interval starts at TRICKLE_IMIN and doubles up to TRICKLE_IMAX
+// while the rank is stable. A beacon is skipped when TRICKLE_REDUNDANCY
+// consistent beacons were already heard in the interval. A rank or parent
+// change, or a beacon from an orphaned neighbour, resets it to TRICKLE_IMIN.
+// Silence is no longer a sign of a dead parent, so the gateway route lives
+// for several maximum intervals and missed ACKs trigger failover instead.
+#define TRICKLE_IMIN 4000               // 4 seconds
+#define TRICKLE_IMAX_DOUBLINGS 6        // up to 256 seconds
+#define TRICKLE_IMAX ((unsigned long)TRICKLE_IMIN << TRICKLE_IMAX_DOUBLINGS)
+#define TRICKLE_REDUNDANCY 2
+#define DODAG_ROUTE_LIFETIME (4 * TRICKLE_IMAX)
+unsigned long trickleInterval = TRICKLE_IMIN;
+unsigned long trickleStart = 0;
+unsigned long trickleFireAt = 0;
+uint8_t trickleHeard = 0;
+bool trickleFired = false;
+uint8_t advertisedRank = ROUTE_COST_INFINITE;
+uint8_t advertisedParent = BROADCAST_ID;
+
+// Link estimation (ETX)
+// Each neighbour keeps an EWMA of RSSI/SNR and of ACK success. Until enough
+// ACK outcomes exist the delivery ratio is predicted from the signal margin.
+// Route selection minimises the summed ETX of the path, carried in frames as
+// tenths (pathCost).
+#define ETX_ALPHA 0.2               // EWMA weight of a new sample
+#define ETX_ACK_SAMPLES 10          // ACK outcomes before the prior is ignored
+#define ETX_MIN_PRR 0.05            // caps a single link at ETX 20
+#define ETX_HYSTERESIS 0.1          // new path must be 10% better to switch
+// SX1276 demodulation limits at 125 kHz, indexed by spreading factor - 7
+const float loraSensitivity[] = {-123, -126, -129, -132, -134.5, -137};   // dBm
+const float loraSnrFloor[] = {-7.5, -10, -12.5, -15, -17.5, -20};         // dB
+unsigned long lastBeaconTime = 0;
+unsigned long nextBeaconDelay = BEACON_INTERVAL;
+uint8_t beaconCounter = 0;
+
+// Downlink (Class-A style)
+// The gateway queues commands per node and sends one right after the ACK of
+// that node's next uplink, or inside the end-to-end ACK. The node listens for
+// DOWNLINK_RX_WINDOW after each successful uplink and confirms the command
+// with MSG_FLAG_DL_ACK on its following uplink; until then the gateway resends
+// the same command ID. The ID of a REBOOT is kept in NVS until a newer command
+// arrives, so a resend after the restart is confirmed rather than run again.
+#define DOWNLINK_RX_WINDOW 1500         // ms, plus the downlink's airtime per hop
+uint16_t lastDownlinkId = 0;
+bool hasDownlinkId = false;
+bool downlinkAckDue = false;
+bool downlinkReceived = false;
+bool forceReport = false;
+bool rebootPending = false;
+
+// Sleepy leaf
+// Instead of running loop() with the radio in RX, the node wakes on the ESP32
+// timer, samples, reports, keeps the downlink RX window open and deep-sleeps
+// until the next sample. Counters, metrics and the gateway route are kept in
+// RTC slow memory, so nothing is rediscovered on wake. A sleepy leaf never
+// relays: it sends no beacons and does not rebroadcast route requests.
+// Awake current comes from the power meter on meterBus (the same feed the
+// measurement sketch logs); the meter cannot be read during deep sleep, so
+// SLEEP_CURRENT_MA is measured once with the board asleep.
+#define SLEEPY_LEAF false
+#define POWER_METER false               // meter feed connected to meterBus
+#define SLEEP_MIN_INTERVAL 1000         // ms
+#define SLEEPY_DISCOVERY_WINDOW 3000    // ms to wait for a route response on wake, plus airtime
+#define SLEEP_CURRENT_MA 0.15           // board in deep sleep
+#define POWER_FEED_CURRENT_FIELD 0      // field of the meter's comma separated line holding mA
+bool wokeFromSleep = false;
+unsigned long clockBase = 0;            // ms slept and awake before this wake
+
+// Low-power listening
+// Relays cannot deep-sleep, so with LPL_MODE they keep the radio asleep and
+// the ESP32 in light sleep, waking every LPL_CHECK_INTERVAL for one Channel
+// Activity Detection. Every frame is sent with a preamble longer than the
+// interval, so a sleeping neighbour always samples it; only link ACKs, whose
+// receiver is awake and waiting, use the normal preamble. Each hop adds at
+// most LPL_CHECK_INTERVAL of latency. Must match the gateway.
+#define LPL_MODE false
+#define LPL_CHECK_INTERVAL 1000         // ms between CAD samples
+#define LPL_PREAMBLE_MARGIN 16          // symbols for the CAD and wake-up jitter
+#define LPL_CAD_TIMEOUT 100             // ms, a CAD takes about two symbols
+#define LPL_FRAME_SYMBOLS 100           // longest frame after the preamble, any SF
+#define LORA_PREAMBLE_LENGTH 8          // library default
+#define LPL_HOP_DELAY (LPL_MODE ? LPL_CHECK_INTERVAL : 0)
+unsigned long lastCadTime = 0;
+volatile bool cadDone = false;
+volatile bool cadDetected = false;
+
+// Energy ledger
+// Estimated joules per subsystem: TX from measured airtime and the current
+// drawn at the configured power, RX for the rest of the awake radio time,
+// CPU for all awake time, and the extra current of SD writes and sensor
+// polls. The model currents are scaled to match the power meter: meter
+// readings and modelled awake energy are compared per calibration window and
+// the ratio is smoothed into the calibration factor. Sleep is not calibrated
+// since the meter cannot be read then.
+#define ENERGY_TX 0
+#define ENERGY_RX 1
+#define ENERGY_CPU 2
+#define ENERGY_SD 3
+#define ENERGY_SENSOR 4
+#define ENERGY_SLEEP 5
+#define ENERGY_CATEGORIES 6
+#define ENERGY_SUPPLY_VOLTAGE 3.3
+#define ENERGY_RX_CURRENT 11.5          // mA, SX1276 RX/standby average
+#define ENERGY_CPU_CURRENT 40.0         // mA, ESP32 at 240 MHz, WiFi off
+#define ENERGY_SD_CURRENT 30.0          // mA on top of the CPU while writing
+#define ENERGY_SENSOR_CURRENT 15.0      // mA on top of the CPU while polling RS485
+#define ENERGY_LIGHT_SLEEP_CURRENT 0.8  // mA, ESP32 light sleep with the radio asleep
+#define ENERGY_CALIBRATION_WINDOW 60000 // ms of awake time
+#define ENERGY_CALIBRATION_SAMPLES 20   // meter lines needed per window
+#define ENERGY_CALIBRATION_ALPHA 0.2
+struct EnergyLedger {
+    double joules[ENERGY_CATEGORIES];
+    float calibration;
+    double windowModelJ;            // uncalibrated, awake categories only
+    unsigned long windowAwakeMs;
+    float windowMeterSum;           // mA
+    unsigned long windowMeterSamples;
+} energy = {{0}, 1.0, 0, 0, 0, 0};
+unsigned long energyCheckpoint = 0;     // micros()
+unsigned long energyTxUs = 0;
+unsigned long energySleptUs = 0;
+
+// Route convergence: time from the last frame heard over a lost gateway route
+// until a replacement is installed
+bool gatewayRouteLost = false;
+unsigned long gatewayRouteLostAt = 0;
 
 // Performance metrics
 struct PerformanceMetrics {
@@ -120,6 +583,34 @@ struct PerformanceMetrics {
     float lastSNR;
     unsigned long uptimeSeconds;
     unsigned long routingTableUpdates;
+    unsigned long reportsSuppressed;
+    unsigned long payloadFieldsDropped;   // H or V left out of a full payload
+    unsigned long dedupHits;
+    unsigned long dedupMisses;
+    unsigned long routeConvergences;
+    unsigned long lastConvergenceMs;
+    unsigned long maxConvergenceMs;
+    unsigned long dataTransmissions;
+    unsigned long routesExpired;
+    unsigned long routesEvicted;
+    unsigned long routeSwitches;
+    unsigned long beaconsSent;
+    unsigned long beaconsSuppressed;
+    unsigned long trickleResets;
+    unsigned long implicitAcks;
+    unsigned long rreqRebroadcasts;
+    unsigned long rreqSuppressed;
+    unsigned long configRejected;
+    unsigned long configFallbacks;
+    unsigned long wakeCycles;
+    unsigned long lastAwakeMs;
+    unsigned long long totalAwakeMs;
+    unsigned long long totalSleepMs;
+    float awakeCurrentSum;          // mA, one sample per power meter line
+    unsigned long awakeCurrentSamples;
+    unsigned long lplChecks;
+    unsigned long lplWakeups;
+    unsigned long lplFalseWakeups;
 } metrics = {0};
 
 // Message structure
@@ -127,12 +618,66 @@ struct LoRaMessage {
     uint8_t messageType;   
     uint8_t sourceId;
     uint8_t destinationId;
+    uint8_t senderId;      // node that transmitted this hop
+    uint8_t nextHopId;     // node that should take this hop, BROADCAST_ID to flood
     uint8_t hopCount;      
-    uint8_t messageId;
+    uint8_t pathCost;      // ETX x10 accumulated from sourceId to senderId
+    uint8_t flags;         // MSG_FLAG_*
+    uint16_t messageId;    // per-source sequence number
     char payload[32];
 } __attribute__((packed));
 
-// Routing table entry structure
+// Payload of MSG_TYPE_DOWNLINK frames and of ACKs with MSG_FLAG_DOWNLINK
+struct DownlinkCommand {
+    uint16_t commandId;
+    char command[30];
+} __attribute__((packed));
+
+// Hop-by-hop acknowledgement of a unicast DATA frame
+struct LinkAck {
+    uint8_t messageType;   // MSG_TYPE_LINK_ACK
+    uint8_t senderId;      // node that took the frame
+    uint8_t receiverId;    // node that transmitted it
+    uint8_t sourceId;      // originator of the frame
+    uint16_t messageId;
+} __attribute__((packed));
+
+// Flooded frames (route requests, config pushes) waiting out their
+// assessment delay
+struct PendingRebroadcast {
+    LoRaMessage msg;
+    unsigned long sendAt;
+    uint8_t copiesHeard;
+    bool active;
+};
+PendingRebroadcast pendingRequests[RREQ_PENDING_SLOTS] = {};
+
+// Compact distance-vector beacon (proactive mode)
+struct RouteBeacon {
+    uint8_t messageType;   // MSG_TYPE_BEACON
+    uint8_t senderId;
+    uint8_t hops;          // hops to the gateway
+    uint8_t cost;          // path ETX x10 to the gateway, ROUTE_COST_INFINITE if none
+    uint8_t beaconId;
+} __attribute__((packed));
+
+// Duplicate suppression
+// Fixed-size ring of recently seen (sourceId, messageId, type, retry) keys. Entries
+// older than DEDUP_TIMEOUT are ignored so a wrapped messageId is not mistaken
+// for a duplicate.
+#define DEDUP_CACHE_SIZE 32
+#define DEDUP_TIMEOUT 60000  // 60 seconds
+struct DedupEntry {
+    uint8_t sourceId;
+    uint16_t messageId;
+    uint8_t messageType;   // 0 marks an empty slot
+    uint8_t retry;         // MSG_FLAG_RETRY_MASK bits of the frame
+    unsigned long timestamp;
+};
+DedupEntry dedupCache[DEDUP_CACHE_SIZE] = {};
+uint8_t dedupNext = 0;
+
+// Routing table entry structure (lookup result, see routing table below)
 struct RoutingEntry {
     uint8_t destinationId;
     uint8_t nextHopId;
@@ -140,12 +685,94 @@ struct RoutingEntry {
     unsigned long lastUpdate;
     int8_t lastRSSI;    
     float lastSNR;      
+    float pathEtx;
+};
+
+// Per-neighbour link estimate
+struct LinkEstimate {
+    uint8_t neighbourId;
+    float rssiAvg;
+    float snrAvg;
+    float ackRatio;
+    uint8_t ackSamples;
+    unsigned long lastHeard;
 };
+#define NEIGHBOUR_TABLE_SIZE 10
+LinkEstimate linkTable[NEIGHBOUR_TABLE_SIZE];
+uint8_t linkTableSize = 0;
+
+// Routing table
+// Open addressing on destination ID with linear probing, filled to at most
+// 75% so probe chains stay short. Fields are kept in parallel arrays so
+// probing only touches the 1-byte key array. Expired entries are swept every
+// ROUTE_EXPIRY_INTERVAL; when the table is full the worst-ETX entry that is
+// neither the gateway route nor an active next hop is evicted, so good
+// parents are never pushed out by far-away nodes. bench/routing_table.cpp
+// times it on the host.
+#define ROUTING_TABLE_SIZE 16           // slots, must be a power of two
+#define ROUTING_TABLE_CAPACITY (ROUTING_TABLE_SIZE - ROUTING_TABLE_SIZE / 4)  // keeps probes short
+#define ROUTE_SLOT_EMPTY BROADCAST_ID   // never a valid destination
+#define ROUTE_EXPIRY_INTERVAL 10000     // 10 seconds
+static_assert((ROUTING_TABLE_SIZE & (ROUTING_TABLE_SIZE - 1)) == 0,
+              "ROUTING_TABLE_SIZE must be a power of two");
+uint8_t rtDestination[ROUTING_TABLE_SIZE];
+uint8_t rtNextHop[ROUTING_TABLE_SIZE];
+uint8_t rtHopCount[ROUTING_TABLE_SIZE];
+float rtPathEtx[ROUTING_TABLE_SIZE];
+unsigned long rtLastUpdate[ROUTING_TABLE_SIZE];
+int8_t rtRssi[ROUTING_TABLE_SIZE];
+float rtSnr[ROUTING_TABLE_SIZE];
+// Fallback next hops per destination, ranked by path ETX (best first). An
+// unused candidate has next hop ROUTE_SLOT_EMPTY.
+#define ROUTE_ALTERNATIVES 2
+uint8_t rtAltNextHop[ROUTING_TABLE_SIZE][ROUTE_ALTERNATIVES];
+uint8_t rtAltHopCount[ROUTING_TABLE_SIZE][ROUTE_ALTERNATIVES];
+float rtAltPathEtx[ROUTING_TABLE_SIZE][ROUTE_ALTERNATIVES];
+unsigned long rtAltLastUpdate[ROUTING_TABLE_SIZE][ROUTE_ALTERNATIVES];
+uint16_t routingTableSize = 0;
+unsigned long lastRouteExpiry = 0;
 
 // Global variables
-RoutingEntry routingTable[10];  
-uint8_t routingTableSize = 0;
-uint8_t messageCounter = 0;
+uint16_t controlCounter = 0;
+
+// Data sequence numbers
+// messageCounter numbers DATA frames and survives reboots. NVS is only written
+// once per SEQ_PERSIST_BLOCK messages; after a reset the node resumes at the
+// end of the last reserved block, so a sequence number is never reused.
+#define SEQ_PERSIST_BLOCK 64
+Preferences preferences;
+uint16_t messageCounter = 0;
+uint16_t seqReservedUntil = 0;
+
+// State carried across deep sleep (SLEEPY_LEAF). Timestamps are in the
+// millis() of the wake that saved them and are shifted on restore.
+struct SleepState {
+    bool valid;
+    unsigned long savedAt;
+    unsigned long sleepMs;
+    unsigned long clockBase;
+    uint16_t messageCounter;
+    uint16_t seqReservedUntil;
+    uint16_t controlCounter;
+    PerformanceMetrics metrics;
+    bool hasRoute;
+    RoutingEntry route;
+    bool hasParentLink;
+    LinkEstimate parentLink;
+    ExceptionChannel exceptionChannels[SENSOR_COUNT];
+    SensorFilter sensorFilters[SENSOR_COUNT];
+    unsigned long lastReportTime;
+    bool hasReported;
+    unsigned long lastRouteDiscovery;
+    unsigned long lastDebugTime;
+    uint16_t lastDownlinkId;
+    bool hasDownlinkId;
+    bool downlinkAckDue;
+    bool rebootPending;
+    bool forceReport;
+    EnergyLedger energy;
+};
+RTC_DATA_ATTR SleepState sleepState;
 
 // Function declarations
 void printLoRaParameters();
@@ -153,26 +780,113 @@ void printRoutingTable();
 void updateMetrics();
 void receiveMessage(int packetSize);
 bool sendMessage(LoRaMessage& msg);
+bool canTransmitData(uint8_t destinationId);
 void generateRandomData(char* payload, int length);
 void dataSensor(char* payload, int length);
+bool checkException(ExceptionChannel& channel, float value);
+bool reportDue();
+void markReported();
 bool findRoute(uint8_t destinationId, RoutingEntry& route);
-void updateRoutingTable(uint8_t sourceId, uint8_t hopCount, int8_t rssi, float snr);
+void invalidateRoute(uint8_t destinationId);
+void initRoutingTable();
+int findRouteSlot(uint8_t destinationId);
+int insertRouteSlot(uint8_t destinationId, float pathEtx);
+void removeRouteSlot(int slot);
+bool isActiveNextHop(uint8_t nodeId);
+void expireRoutes();
+void addAlternative(int slot, uint8_t nextHopId, uint8_t hopCount, float pathEtx, unsigned long lastUpdate);
+void removeAlternative(int slot, uint8_t nextHopId);
+bool promoteAlternative(int slot, unsigned long timeout);
+bool failoverRoute(uint8_t destinationId, uint8_t failedHopId);
+void updateRoutingTable(uint8_t destinationId, uint8_t nextHopId, uint8_t hopCount, float pathEtx, int8_t rssi, float snr);
+LinkEstimate* findLink(uint8_t neighbourId, bool create);
+void updateLinkSignal(uint8_t neighbourId, int rssi, float snr);
+void recordLinkResult(uint8_t neighbourId, bool acked);
+float linkEtx(uint8_t neighbourId);
+uint8_t encodeEtx(float etx);
+bool isDuplicate(const LoRaMessage& msg);
 void printDebugInfo();
 bool initLoRa();
 void initiateRouteDiscovery();
-bool waitForAck(uint8_t messageId);
-void sendAck(uint8_t messageId, uint8_t destinationId);
+void scheduleRebroadcast(const LoRaMessage& msg);
+void noteRequestCopy(const LoRaMessage& msg);
+void processPendingRebroadcasts();
+void sendBeacon();
+void receiveBeacon();
+void checkGatewayRoute();
+void trickleStartInterval();
+void trickleReset();
+void runTrickle();
+unsigned long routeLifetime(uint8_t destinationId);
+bool waitForAck(uint16_t messageId);
+bool waitForLinkAck(uint8_t nextHopId, const LoRaMessage& msg);
+void sendLinkAck(const LoRaMessage& msg);
+void sendAck(uint16_t messageId, uint8_t destinationId);
 void sendRouteResponse(uint8_t destinationId);
 void blinkLED0(CRGB color, int count, int delayMs);
 void initSDCard();
-void bacaRain();
-void bacaDistance();
+void modbusRefreshWait();
+float filterReading(SensorFilter& filter, float reading, bool ok);
+void sampleSensors(unsigned long since);
+void printSensors(File& file);
 void Datalog();
 void DatalogError();
 void DatalogRoutingTables();
 void DatalogNodeStatus();
 void ledFunction();
 void resetLoRa();
+void initSequence();
+void reserveSequenceBlock();
+uint16_t nextSequence();
+void loadConfig();
+void loadConfigKey();
+void loadDownlinkState();
+bool receiveConfig(const LoRaMessage& msg);
+void signConfig(const NetworkConfig& config, uint8_t* signature);
+void checkPendingConfig();
+void applyConfig(const NetworkConfig& config);
+bool radioDiffers(const NetworkConfig& a, const NetworkConfig& b);
+void noteFrameHeard();
+void openRxWindow();
+void handleDownlink(const LoRaMessage& msg);
+void executeCommand(const char* command);
+bool sendReport();
+void runSleepyCycle();
+void goToSleep();
+void saveSleepState(unsigned long sleepMs);
+void restoreSleepState();
+void samplePowerFeed();
+float averageCurrent();
+long lplPreambleLength(uint8_t spreadingFactor);
+unsigned long frameAirtime(uint8_t bytes);
+int lplListen();
+void onCadDone(bool detected);
+Stream* beginSensorBus(int uart, SoftwareSerial& fallback, int8_t rxPin, int8_t txPin, unsigned long baud);
+HardwareSerial& sensorUart(int uart);
+void onModbusRxIdle();
+void beginSerialProfile();
+void onProfileTimer();
+void profileSpin();
+float profileLatency();
+float profileLoad();
+bool transmitPacket();
+void pollSensors();
+void parseDistance();
+void parseDistanceByte(uint8_t value);
+bool distanceCurrent();
+bool modbusReadRegisters(uint8_t slaveId, uint8_t function, uint16_t startRegister, uint16_t count);
+void modbusPoll();
+bool modbusValidate();
+void buildModbusBlocks();
+void modbusSchedule();
+void modbusPublish(int block, bool success);
+void modbusRefresh();
+bool modbusRefreshDone();
+bool modbusValue(uint8_t point, float& value);
+bool modbusFresh(uint8_t point, unsigned long since);
+void chargeEnergy(uint8_t category, double seconds, float currentMa);
+void updateEnergy();
+float txCurrent(int8_t txPower);
 
 
 // Function to print LoRa parameters
@@ -180,9 +894,10 @@ void printLoRaParameters() {
     DEBUG_PRINTLN("\n=== LoRa Parameters ===");
     DEBUG_PRINTF("Frequency: %.2f MHz\n", FREQUENCY/1E6);
     DEBUG_PRINTF("Bandwidth: %.2f kHz\n", BANDWIDTH/1E3);
-    DEBUG_PRINTF("Spreading Factor: %d\n", SPREADING_FACTOR);
-    DEBUG_PRINTF("TX Power: %d dBm\n", TX_POWER);
+    DEBUG_PRINTF("Spreading Factor: %d\n", activeConfig.spreadingFactor);
+    DEBUG_PRINTF("TX Power: %d dBm\n", activeConfig.txPower);
     DEBUG_PRINTF("Sync Word: 0x%02X\n", SYNC_WORD);
+    DEBUG_PRINTF("Config Version: %u\n", activeConfig.version);
     DEBUG_PRINTLN("=====================");
 }
 
@@ -198,10 +913,14 @@ bool initLoRa() {
         return false;
     }
     
-    LoRa.setSpreadingFactor(SPREADING_FACTOR);
+    LoRa.setSpreadingFactor(activeConfig.spreadingFactor);
     LoRa.setSignalBandwidth(BANDWIDTH);
-    LoRa.setTxPower(TX_POWER);
+    LoRa.setTxPower(activeConfig.txPower);
     LoRa.setSyncWord(SYNC_WORD);
+    LoRa.setPreambleLength(LPL_MODE ? lplPreambleLength(activeConfig.spreadingFactor) : LORA_PREAMBLE_LENGTH);
+    if (LPL_MODE) {
+        LoRa.onCadDone(onCadDone);
+    }
     
     DEBUG_PRINTLN("LoRa.begin() successful.");
     DEBUG_PRINTLN("LoRa settings applied.");
@@ -210,20 +929,52 @@ bool initLoRa() {
 }
 
 void setup() {
+    wokeFromSleep = SLEEPY_LEAF && sleepState.valid &&
+                    esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER;
+
     Serial.begin(115200);
-    mySerial.begin(9600);
-    mySerial1.begin(9600);
+    if (SERIAL_PROFILE) {
+        beginSerialProfile();
+    }
+    modbusBus = beginSensorBus(MODBUS_UART, mySerial, MODBUS_RX_PIN, MODBUS_TX_PIN, MODBUS_BAUD);
+    if (MODBUS_UART != SENSOR_UART_SOFTWARE) {
+        sensorUart(MODBUS_UART).setRxTimeout(MODBUS_RX_TIMEOUT);
+        sensorUart(MODBUS_UART).onReceive(onModbusRxIdle, true);
+    }
+    distanceBus = beginSensorBus(DISTANCE_UART, mySerial1, DISTANCE_RX_PIN, DISTANCE_TX_PIN, DISTANCE_BAUD);
+    if (DISTANCE_UART != SENSOR_UART_SOFTWARE) {
+        // One interrupt per frame, the RX timeout flushes a partial one
+        sensorUart(DISTANCE_UART).setRxFIFOFull(DISTANCE_FRAME_SIZE);
+    }
+    if (POWER_METER) {
+        meterBus = beginSensorBus(POWER_METER_UART, mySerial2, POWER_METER_RX_PIN, POWER_METER_TX_PIN, POWER_METER_BAUD);
+    }
     Wire.begin();  
 
     // Fungsi LED
     FastLED.addLeds<WS2812, LED_PIN, GRB>(leds, NUM_LEDS);
-    leds[0] = CRGB(0, 255, 0);      // LED 0 warna hijau dengan kecerahan penuh
-    leds[0].nscale8(255);           // Set kecerahan LED 0
-    FastLED.show();
+    if (!SLEEPY_LEAF) {
+        leds[0] = CRGB(0, 255, 0);      // LED 0 warna hijau dengan kecerahan penuh
+        leds[0].nscale8(255);           // Set kecerahan LED 0
+        FastLED.show();
+    }
     
     // Inisialisasi SD Card
     initSDCard();
 
+    initSequence();
+    loadConfigKey();
+    loadConfig();
+    loadDownlinkState();
+    initRoutingTable();
+    buildModbusBlocks();
+    if (wokeFromSleep) {
+        restoreSleepState();
+    }
+    if (ROUTING_MODE == ROUTING_CONVERGECAST) {
+        trickleStartInterval();
+    }
+
     while (!Serial && millis() < 5000);
     
     DEBUG_PRINTLN("\n=== LoRa Multi-Hop Node Starting ===");
@@ -243,53 +994,75 @@ void setup() {
     digitalWrite(enTxPin, HIGH);
 
     printLoRaParameters();
+
+    if (SLEEPY_LEAF) {
+        // Never returns, the next wake starts again in setup()
+        runSleepyCycle();
+    }
 }
 
 void loop() {
 
-    ledFunction();
-    int packetSize = LoRa.parsePacket();
+    if (SERIAL_PROFILE) {
+        profileSpin();
+    }
+
+    int packetSize;
+    if (LPL_MODE && !IS_GATEWAY(NODE_ID)) {
+        packetSize = lplListen();
+    } else {
+        ledFunction();
+        packetSize = LoRa.parsePacket();
+    }
     if (packetSize) {
         receiveMessage(packetSize);
     }
+
+    checkGatewayRoute();
+    processPendingRebroadcasts();
+    checkPendingConfig();
+    if (POWER_METER) {
+        samplePowerFeed();
+    }
+
+    if (millis() - lastRouteExpiry > ROUTE_EXPIRY_INTERVAL) {
+        expireRoutes();
+        lastRouteExpiry = millis();
+    }
+
+    if (ROUTING_MODE == ROUTING_PROACTIVE && millis() - lastBeaconTime > nextBeaconDelay) {
+        sendBeacon();
+    } else if (ROUTING_MODE == ROUTING_CONVERGECAST) {
+        runTrickle();
+    }
     
-    if (NODE_ID != GATEWAY_ID) {
-        static unsigned long lastSendTime = 0;
-        if (millis() - lastSendTime > 30000) {  
-            LoRaMessage msg;
-            msg.messageType = MSG_TYPE_DATA;
-            msg.sourceId = NODE_ID;
-            msg.destinationId = GATEWAY_ID;
-            msg.hopCount = 0;
-            msg.messageId = messageCounter++;
+    if (!IS_GATEWAY(NODE_ID)) {
+        static unsigned long lastSampleTime = 0;
+        if (millis() - lastSampleTime > activeConfig.sampleInterval && !samplePending) {  
+            lastSampleTime = millis();
 
             // Using data from sensor, comment this if you want to use random data
-            bacaRain();
-            bacaDistance();
-            dataSensor(msg.payload, sizeof(msg.payload) - 1);
+            modbusRefresh();
+            samplePending = true;
+        }
 
-            // Using data random, comment this if you want to use sensor data
-            // generateRandomData(msg.payload, sizeof(msg.payload) - 1);
+        modbusPoll();
+        modbusSchedule();
+        parseDistance();
+        if (samplePending && modbusRefreshDone() &&
+            (distanceCurrent() || millis() - lastSampleTime >= DISTANCE_TIMEOUT)) {
+            samplePending = false;
+            sampleSensors(lastSampleTime);
 
-            DEBUG_PRINT("Sending message: ");
-            DEBUG_PRINTLN(msg.payload);
-            
-            if (sendMessage(msg)) {
-                DEBUG_PRINTLN("Message sent successfully");
-                blinkLED0(CRGB::Blue, 2, 100);
-                metrics.messagesSent++;
-                Datalog();
+            if (reportDue() || forceReport) {
+                sendReport();
             } else {
-                DEBUG_PRINTLN("Failed to send message");
-                metrics.messagesFailed++;
-                DatalogError();
+                metrics.reportsSuppressed++;
             }
-            
-            lastSendTime = millis();
         }
     }
     
-    if (millis() - lastDebugTime > DEBUG_INTERVAL) {
+    if (millis() - lastDebugTime > activeConfig.debugInterval) {
         printDebugInfo();
         DatalogRoutingTables();
         DatalogNodeStatus();
@@ -300,37 +1073,142 @@ void loop() {
 
 }
 
+bool sendReport() {
+    LoRaMessage msg;
+    msg.messageType = MSG_TYPE_DATA;
+    msg.sourceId = NODE_ID;
+    msg.destinationId = GATEWAY_ID;
+    msg.senderId = NODE_ID;
+    msg.nextHopId = BROADCAST_ID;
+    msg.hopCount = 0;
+    msg.pathCost = 0;
+    msg.flags = E2E_CONFIRM ? MSG_FLAG_CONFIRM : 0;
+    if (downlinkAckDue) {
+        msg.flags |= MSG_FLAG_DL_ACK;
+    }
+    msg.messageId = nextSequence();
+
+    dataSensor(msg.payload, sizeof(msg.payload) - 1);
+
+    // Using data random, comment this if you want to use sensor data
+    // generateRandomData(msg.payload, sizeof(msg.payload) - 1);
+
+    DEBUG_PRINT("Sending message: ");
+    DEBUG_PRINTLN(msg.payload);
+    
+    // A downlink received during the send may set it again
+    forceReport = false;
+    if (sendMessage(msg)) {
+        // First, while the gateway may still be answering
+        if (msg.flags & MSG_FLAG_DL_ACK) {
+            downlinkAckDue = false;
+            if (rebootPending) {
+                ESP.restart();
+            }
+        }
+        openRxWindow();
+        DEBUG_PRINTLN("Message sent successfully");
+        if (!SLEEPY_LEAF) {
+            blinkLED0(CRGB::Blue, 2, 100);
+        }
+        metrics.messagesSent++;
+        markReported();
+        Datalog();
+        return true;
+    }
+    DEBUG_PRINTLN("Failed to send message");
+    metrics.messagesFailed++;
+    DatalogError();
+    return false;
+}
+
+// Whether sendMessage would put a DATA frame on air now, rather than only
+// starting route discovery
+bool canTransmitData(uint8_t destinationId) {
+    RoutingEntry route;
+    return findRoute(destinationId, route) || ROUTING_MODE != ROUTING_ON_DEMAND ||
+           millis() - lastRouteDiscovery <= ROUTE_DISCOVERY_INTERVAL;
+}
+
 bool sendMessage(LoRaMessage& msg) {
-    if (!hasValidRoute && msg.messageType == MSG_TYPE_DATA) {
-        if (millis() - lastRouteDiscovery > ROUTE_DISCOVERY_INTERVAL) {
-            initiateRouteDiscovery();
-            return false;
+    bool unicast = false;
+    if (msg.messageType == MSG_TYPE_DATA) {
+        RoutingEntry route;
+        if (findRoute(msg.destinationId, route)) {
+            msg.nextHopId = route.nextHopId;
+            unicast = true;
+        } else {
+            if (ROUTING_MODE == ROUTING_ON_DEMAND &&
+                millis() - lastRouteDiscovery > ROUTE_DISCOVERY_INTERVAL) {
+                initiateRouteDiscovery();
+                return false;
+            }
+            // No route yet: flood while discovery or beacons are pending.
+            // Nobody link-ACKs a flood, so the source asks for confirmation.
+            msg.nextHopId = BROADCAST_ID;
+            if (msg.sourceId == NODE_ID) {
+                msg.flags |= MSG_FLAG_CONFIRM;
+            }
         }
     }
+    msg.senderId = NODE_ID;
     if (msg.hopCount >= MAX_HOPS) {
         DEBUG_PRINTLN("Maximum hop count exceeded");
         return false;
     }
     
-    for (int i = 0; i < RETRY_COUNT; i++) {
-        DEBUG_PRINTF("Transmission attempt %d/%d\n", i + 1, RETRY_COUNT);
-        DEBUG_PRINTF("Sending message - Type: %d, ID: %d, Dest: %d\n",
-            msg.messageType, msg.messageId, msg.destinationId);
+    int attempt = 0;
+    uint8_t missedAcks = 0;
+    bool linkLost = false;
+    while (attempt < RETRY_COUNT) {
+        attempt++;
+        DEBUG_PRINTF("Transmission attempt %d/%d\n", attempt, RETRY_COUNT);
+        DEBUG_PRINTF("Sending message - Type: %d, ID: %d, Dest: %d, Next Hop: %d\n",
+            msg.messageType, msg.messageId, msg.destinationId, msg.nextHopId);
         
         LoRa.beginPacket();
         LoRa.write((uint8_t*)&msg, sizeof(LoRaMessage));
+        if (msg.messageType == MSG_TYPE_DATA) {
+            metrics.dataTransmissions++;
+        }
         
-        if (LoRa.endPacket()) {
+        if (transmitPacket()) {
             DEBUG_PRINTLN("Packet sent. Waiting for ACK...");
             DEBUG_PRINTF("RSSI: %d, SNR: %.2f\n", 
                         LoRa.packetRssi(),
                         LoRa.packetSnr());
             if (msg.messageType == MSG_TYPE_DATA) {
-                if (waitForAck(msg.messageId)) {
+                bool delivered = true;
+                if (unicast) {
+                    delivered = waitForLinkAck(msg.nextHopId, msg);
+                    recordLinkResult(msg.nextHopId, delivered);
+                    linkLost = !delivered;
+                }
+                // Only the source waits for the destination; relays are done
+                // as soon as the next hop has the frame
+                bool confirm = msg.sourceId == NODE_ID && (msg.flags & MSG_FLAG_CONFIRM);
+                if (delivered && confirm && !waitForAck(msg.messageId)) {
+                    DEBUG_PRINTLN("End-to-end ACK not received.");
+                    // Relays already hold this attempt in their dedup cache
+                    msg.flags = (msg.flags & ~MSG_FLAG_RETRY_MASK) |
+                                ((msg.flags + MSG_FLAG_RETRY_STEP) & MSG_FLAG_RETRY_MASK);
+                } else if (delivered) {
                     DEBUG_PRINTLN("ACK received");
                     return true;
                 } else {
                     DEBUG_PRINTLN("ACK not received.");
+                    if (unicast) {
+                        missedAcks++;
+                        if (missedAcks >= FAILOVER_MISSED_ACKS &&
+                            failoverRoute(msg.destinationId, msg.nextHopId)) {
+                            // Fresh retry budget on the next candidate
+                            RoutingEntry route;
+                            findRoute(msg.destinationId, route);
+                            msg.nextHopId = route.nextHopId;
+                            missedAcks = 0;
+                            attempt = 0;
+                        }
+                    }
                 }
             } else {
                 return true;
@@ -346,23 +1224,26 @@ bool sendMessage(LoRaMessage& msg) {
         
         delay(random(500, 1500));
     }
-    
-    return false;
-}
 
-void parsePayload(const char* payload, float* rain_val, float* distance_val) {
-    char* ptr = strstr(payload, "R:");
-    if (ptr) {
-        *rain_val = atof(ptr + 2);
-    }
-    
-    ptr = strstr(payload, "D:");
-    if (ptr) {
-        *distance_val = atof(ptr + 2);
+    if (linkLost) {
+        // Next hop is unreachable, rediscover on the next send
+        invalidateRoute(msg.destinationId);
     }
+    return false;
 }
 
 void receiveMessage(int packetSize) {
+    noteFrameHeard();
+    if (packetSize == sizeof(RouteBeacon)) {
+        receiveBeacon();
+        return;
+    }
+    if (packetSize == sizeof(LinkAck)) {
+        // Link ACKs are consumed inside sendMessage; a late one is dropped
+        LinkAck linkAck;
+        LoRa.readBytes((uint8_t*)&linkAck, sizeof(LinkAck));
+        return;
+    }
     if (packetSize != sizeof(LoRaMessage)) {
         DEBUG_PRINTF("Invalid packet size: %d bytes\n", packetSize);
         return;
@@ -374,45 +1255,356 @@ void receiveMessage(int packetSize) {
     metrics.lastRSSI = LoRa.packetRssi();
     metrics.lastSNR = LoRa.packetSnr();
     
-    updateRoutingTable(msg.sourceId, msg.hopCount, metrics.lastRSSI, metrics.lastSNR);
+    // The transmitter is a direct neighbour; the originator is reachable
+    // through it (reverse path). Links are assumed symmetric, so the cost
+    // of the hop just taken is our estimate towards the sender.
+    updateLinkSignal(msg.senderId, metrics.lastRSSI, metrics.lastSNR);
+    float hopEtx = linkEtx(msg.senderId);
+    float arrivalEtx = msg.pathCost / 10.0 + hopEtx;
+    updateRoutingTable(msg.senderId, msg.senderId, 1, hopEtx, metrics.lastRSSI, metrics.lastSNR);
+    if (IS_GATEWAY(msg.senderId)) {
+        updateRoutingTable(GATEWAY_ID, msg.senderId, 1, hopEtx, metrics.lastRSSI, metrics.lastSNR);
+    }
+    if (msg.sourceId != msg.senderId && msg.sourceId != NODE_ID) {
+        // Any gateway is a route to the anycast address
+        uint8_t destination = IS_GATEWAY(msg.sourceId) ? GATEWAY_ID : msg.sourceId;
+        updateRoutingTable(destination, msg.senderId, msg.hopCount + 1, arrivalEtx, metrics.lastRSSI, metrics.lastSNR);
+    }
+    // Carried onwards if this node forwards the frame
+    msg.pathCost = encodeEtx(arrivalEtx);
+
+    // Unicast frames are only handled by the node they are addressed to
+    if (msg.nextHopId != NODE_ID && msg.nextHopId != BROADCAST_ID) {
+        return;
+    }
+
+    bool duplicate = isDuplicate(msg);
+    bool forUs = msg.destinationId == NODE_ID || (msg.destinationId == GATEWAY_ID && IS_GATEWAY(NODE_ID));
+    // Copy already forwarded, or a retry after our link ACK was lost. An
+    // end-to-end retry carries a new retry count, so it is not a duplicate.
+    bool staleCopy = duplicate;
+    RoutingEntry route;
     
     switch (msg.messageType) {
-        case MSG_TYPE_DATA:
-            if (msg.destinationId == NODE_ID) {
-                sendAck(msg.messageId, msg.sourceId);
-                parsePayload(msg.payload, &rain_val, &distance_val);
+        case MSG_TYPE_DATA: {
+            // The forwarded copy still has to fit within MAX_HOPS
+            bool forward = !forUs && !staleCopy && msg.hopCount + 1 < MAX_HOPS;
+            if (forward && ROUTING_MODE == ROUTING_CONVERGECAST && msg.nextHopId == NODE_ID &&
+                findRoute(msg.destinationId, route) && route.nextHopId == msg.senderId) {
+                // Our parent forwarded through us: rank loop, drop that parent
+                DEBUG_PRINTF("Rank loop via Node %d detected\n", msg.senderId);
+                if (!failoverRoute(msg.destinationId, msg.senderId)) {
+                    invalidateRoute(msg.destinationId);
+                }
+            }
+            // Always ACK: a duplicate means our previous ACK was lost. In
+            // implicit mode a relay's own forward serves as the ACK, except
+            // under LPL where the forward's wake-up preamble makes it too late,
+            // and only if the forward goes on air.
+            bool implicitAck = msg.nextHopId == NODE_ID && IMPLICIT_ACK && !LPL_MODE &&
+                               forward && canTransmitData(msg.destinationId);
+            if (msg.nextHopId == NODE_ID && !implicitAck) {
+                sendLinkAck(msg);
+            }
+            if (forUs) {
+                if (msg.flags & MSG_FLAG_CONFIRM) {
+                    sendAck(msg.messageId, msg.sourceId);
+                }
+                if (duplicate) {
+                    DEBUG_PRINTF("Duplicate data from Node %d (ID: %d) ignored\n", msg.sourceId, msg.messageId);
+                    break;
+                }
+                float values[SENSOR_COUNT] = {};
+                decodeSensors(msg.payload, values);
                 DEBUG_PRINTLN("=== Data received ===");
                 DEBUG_PRINTF("From Node: %d\n", msg.sourceId);
                 DEBUG_PRINTF("Raw payload: %s\n", msg.payload);
-                DEBUG_PRINTF("Rain Value: %.2f%%\n", rain_val);
-                DEBUG_PRINTF("Distance: %.2f cm\n", distance_val);
+                for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+                    DEBUG_PRINTF("%s: %.*f %s\n", sensorFields[i].name, sensorFields[i].decimals,
+                                values[i], sensorFields[i].unit);
+                }
                 DEBUG_PRINTLN("==================");
-            } else if (msg.hopCount < MAX_HOPS) {
+            } else if (staleCopy) {
+                DEBUG_PRINTF("Duplicate data from Node %d (ID: %d) not forwarded\n", msg.sourceId, msg.messageId);
+            } else if (forward) {
+                LoRaMessage received = msg;
                 msg.hopCount++;
-                sendMessage(msg);
-                metrics.messagesForwarded++;
+                if (sendMessage(msg)) {
+                    metrics.messagesForwarded++;
+                } else if (implicitAck) {
+                    // The forward may never have gone out; a late LinkAck is
+                    // ignored if the previous hop has already moved on
+                    sendLinkAck(received);
+                }
+            } else {
+                DEBUG_PRINTF("Data from Node %d (ID: %d) dropped, hop limit reached\n",
+                            msg.sourceId, msg.messageId);
             }
             break;
+        }
             
         case MSG_TYPE_ROUTE_REQUEST:
-            if (NODE_ID == GATEWAY_ID) {
+            if (duplicate) {
+                DEBUG_PRINTF("Duplicate route request from Node %d dropped\n", msg.sourceId);
+                noteRequestCopy(msg);
+            } else if (IS_GATEWAY(NODE_ID) || msg.destinationId == NODE_ID) {
+                // Reverse path to the requester was recorded above
                 sendRouteResponse(msg.sourceId);
-            } else if (msg.hopCount < MAX_HOPS) {
+            } else if (!SLEEPY_LEAF && msg.hopCount < MAX_HOPS) {
+                // A sleepy leaf would be asleep when the route gets used
                 msg.hopCount++;
-                LoRa.beginPacket();
-                LoRa.write((uint8_t*)&msg, sizeof(LoRaMessage));
-                LoRa.endPacket();
+                msg.senderId = NODE_ID;
+                scheduleRebroadcast(msg);
             }
             break;
             
         case MSG_TYPE_ROUTE_RESPONSE:
+            // Forward route to the responder was recorded above
+            if (msg.destinationId == NODE_ID) {
+                DEBUG_PRINTF("Route to Node %d established via %d (%d hops)\n",
+                            msg.sourceId, msg.senderId, msg.hopCount + 1);
+            } else if (msg.hopCount < MAX_HOPS && findRoute(msg.destinationId, route)) {
+                // Unicast back towards the requester along the reverse path
+                msg.hopCount++;
+                msg.senderId = NODE_ID;
+                msg.nextHopId = route.nextHopId;
+                LoRa.beginPacket();
+                LoRa.write((uint8_t*)&msg, sizeof(LoRaMessage));
+                transmitPacket();
+                metrics.messagesForwarded++;
+            }
+            break;
+
+        case MSG_TYPE_CONFIG:
+            // Flooded like a route request, including its copy suppression;
+            // only authentic configs newer than ours are passed on, and not by
+            // a sleepy leaf, which must never look like a next hop
+            if (duplicate) {
+                noteRequestCopy(msg);
+                break;
+            }
+            if (receiveConfig(msg) && !SLEEPY_LEAF && msg.destinationId != NODE_ID && msg.hopCount < MAX_HOPS) {
+                msg.hopCount++;
+                msg.senderId = NODE_ID;
+                scheduleRebroadcast(msg);
+            }
+            break;
+
+        case MSG_TYPE_DOWNLINK:
             if (msg.destinationId == NODE_ID) {
-                hasValidRoute = true;
+                handleDownlink(msg);
+                break;
+            }
+            // Other nodes' downlinks travel the reverse path like ACKs
+            // fall through
+        case MSG_TYPE_ACK:
+            // ACKs are relayed along the reverse path; duplicates are passed
+            // on too because a repeated ACK answers a repeated DATA frame
+            if (msg.destinationId != NODE_ID && msg.hopCount < MAX_HOPS &&
+                findRoute(msg.destinationId, route)) {
+                msg.hopCount++;
+                msg.senderId = NODE_ID;
+                msg.nextHopId = route.nextHopId;
+                LoRa.beginPacket();
+                LoRa.write((uint8_t*)&msg, sizeof(LoRaMessage));
+                transmitPacket();
             }
             break;
     }
 }
 
+void sendBeacon() {
+    RoutingEntry route;
+    RouteBeacon beacon;
+    beacon.messageType = MSG_TYPE_BEACON;
+    beacon.senderId = NODE_ID;
+    beacon.beaconId = beaconCounter++;
+    if (IS_GATEWAY(NODE_ID)) {
+        beacon.hops = 0;
+        beacon.cost = 0;
+    } else if (findRoute(GATEWAY_ID, route)) {
+        beacon.hops = route.hopCount;
+        beacon.cost = encodeEtx(route.pathEtx);
+    } else {
+        // Advertise the loss so children re-parent immediately
+        beacon.hops = ROUTE_COST_INFINITE;
+        beacon.cost = ROUTE_COST_INFINITE;
+    }
+
+    LoRa.beginPacket();
+    LoRa.write((uint8_t*)&beacon, sizeof(RouteBeacon));
+    transmitPacket();
+    DEBUG_PRINTF("Beacon sent - Hops: %d, ETX: %.1f\n", beacon.hops, beacon.cost / 10.0);
+    metrics.beaconsSent++;
+    advertisedRank = beacon.cost;
+    advertisedParent = (!IS_GATEWAY(NODE_ID) && beacon.cost != ROUTE_COST_INFINITE) ? route.nextHopId : BROADCAST_ID;
+
+    lastBeaconTime = millis();
+    nextBeaconDelay = BEACON_INTERVAL + random(0, BEACON_JITTER);
+}
+
+void receiveBeacon() {
+    RouteBeacon beacon;
+    LoRa.readBytes((uint8_t*)&beacon, sizeof(RouteBeacon));
+    if (beacon.messageType != MSG_TYPE_BEACON || beacon.senderId == NODE_ID) {
+        return;
+    }
+
+    metrics.lastRSSI = LoRa.packetRssi();
+    metrics.lastSNR = LoRa.packetSnr();
+    updateLinkSignal(beacon.senderId, metrics.lastRSSI, metrics.lastSNR);
+    float hopEtx = linkEtx(beacon.senderId);
+    updateRoutingTable(beacon.senderId, beacon.senderId, 1, hopEtx, metrics.lastRSSI, metrics.lastSNR);
+
+    RoutingEntry route;
+    bool hasRoute = IS_GATEWAY(NODE_ID) || findRoute(GATEWAY_ID, route);
+    bool orphan = beacon.cost == ROUTE_COST_INFINITE || beacon.hops >= MAX_HOPS;
+    if (ROUTING_MODE == ROUTING_CONVERGECAST) {
+        if (!orphan) {
+            trickleHeard++;
+        } else if (hasRoute && (IS_GATEWAY(NODE_ID) || route.nextHopId != beacon.senderId)) {
+            // A neighbour without a rank: advertise ours soon
+            trickleReset();
+        }
+    }
+
+    if (IS_GATEWAY(NODE_ID)) {
+        return;
+    }
+
+    if (orphan) {
+        // Our parent lost its own route or is too far away
+        if (hasRoute && route.nextHopId == beacon.senderId) {
+            invalidateRoute(GATEWAY_ID);
+        }
+        return;
+    }
+    if (ROUTING_MODE == ROUTING_CONVERGECAST && hasRoute && route.nextHopId != beacon.senderId &&
+        beacon.cost >= encodeEtx(route.pathEtx)) {
+        // Same or greater rank is a child or sibling, never a parent candidate
+        removeAlternative(findRouteSlot(GATEWAY_ID), beacon.senderId);
+        return;
+    }
+    updateRoutingTable(GATEWAY_ID, beacon.senderId, beacon.hops + 1, beacon.cost / 10.0 + hopEtx,
+                       metrics.lastRSSI, metrics.lastSNR);
+}
+
+// Drops the gateway route once its next hop has been silent too long. In
+// proactive mode that is a few missed beacons instead of the full timeout.
+void checkGatewayRoute() {
+    if (IS_GATEWAY(NODE_ID)) {
+        return;
+    }
+    unsigned long timeout = (ROUTING_MODE == ROUTING_PROACTIVE) ? PARENT_TIMEOUT : routeLifetime(GATEWAY_ID);
+    int slot = findRouteSlot(GATEWAY_ID);
+    if (slot >= 0 && millis() - rtLastUpdate[slot] >= timeout && !promoteAlternative(slot, timeout)) {
+        invalidateRoute(GATEWAY_ID);
+    }
+}
+
+// Starts a trickle interval with the transmit point in its second half
+void trickleStartInterval() {
+    trickleStart = millis();
+    trickleFireAt = trickleInterval / 2 + random(0, trickleInterval / 2);
+    trickleHeard = 0;
+    trickleFired = false;
+}
+
+void trickleReset() {
+    if (trickleInterval == TRICKLE_IMIN) {
+        return;
+    }
+    trickleInterval = TRICKLE_IMIN;
+    metrics.trickleResets++;
+    trickleStartInterval();
+}
+
+void runTrickle() {
+    // Rank or parent moved since the last beacon: tell the children soon
+    RoutingEntry route;
+    uint8_t rank = ROUTE_COST_INFINITE;
+    uint8_t parent = BROADCAST_ID;
+    if (IS_GATEWAY(NODE_ID)) {
+        rank = 0;
+    } else if (findRoute(GATEWAY_ID, route)) {
+        rank = encodeEtx(route.pathEtx);
+        parent = route.nextHopId;
+    }
+    if (parent != advertisedParent || abs((int)rank - (int)advertisedRank) > advertisedRank * ETX_HYSTERESIS) {
+        trickleReset();
+    }
+
+    unsigned long elapsed = millis() - trickleStart;
+    if (!trickleFired && elapsed >= trickleFireAt) {
+        trickleFired = true;
+        if (trickleHeard < TRICKLE_REDUNDANCY) {
+            sendBeacon();
+        } else {
+            metrics.beaconsSuppressed++;
+        }
+    }
+    if (elapsed >= trickleInterval) {
+        if (trickleInterval < TRICKLE_IMAX) {
+            trickleInterval *= 2;
+        }
+        trickleStartInterval();
+    }
+}
+
+// In convergecast mode the gateway route is refreshed by trickle beacons that
+// may be minutes apart, so it outlives the usual route timeout
+unsigned long routeLifetime(uint8_t destinationId) {
+    if (ROUTING_MODE == ROUTING_CONVERGECAST && destinationId == GATEWAY_ID) {
+        return DODAG_ROUTE_LIFETIME;
+    }
+    return ROUTE_TIMEOUT;
+}
+
+void scheduleRebroadcast(const LoRaMessage& msg) {
+    for (int i = 0; i < RREQ_PENDING_SLOTS; i++) {
+        if (!pendingRequests[i].active) {
+            pendingRequests[i].msg = msg;
+            pendingRequests[i].sendAt = millis() + random(0, RREQ_ASSESSMENT_DELAY);
+            pendingRequests[i].copiesHeard = 0;
+            pendingRequests[i].active = true;
+            return;
+        }
+    }
+    // All slots busy: neighbours are flooding heavily, so skip this one
+    metrics.rreqSuppressed++;
+}
+
+void noteRequestCopy(const LoRaMessage& msg) {
+    for (int i = 0; i < RREQ_PENDING_SLOTS; i++) {
+        PendingRebroadcast& pending = pendingRequests[i];
+        if (pending.active && pending.msg.sourceId == msg.sourceId &&
+            pending.msg.messageId == msg.messageId) {
+            pending.copiesHeard++;
+            return;
+        }
+    }
+}
+
+void processPendingRebroadcasts() {
+    for (int i = 0; i < RREQ_PENDING_SLOTS; i++) {
+        PendingRebroadcast& pending = pendingRequests[i];
+        if (!pending.active || (long)(millis() - pending.sendAt) < 0) {
+            continue;
+        }
+        pending.active = false;
+        if (pending.copiesHeard >= RREQ_COPY_THRESHOLD) {
+            DEBUG_PRINTF("Route request from Node %d suppressed (%d copies heard)\n",
+                        pending.msg.sourceId, pending.copiesHeard);
+            metrics.rreqSuppressed++;
+            continue;
+        }
+        LoRa.beginPacket();
+        LoRa.write((uint8_t*)&pending.msg, sizeof(LoRaMessage));
+        transmitPacket();
+        metrics.rreqRebroadcasts++;
+    }
+}
+
 void initiateRouteDiscovery() {
     DEBUG_PRINTLN("Initiating route discovery");
     
@@ -420,12 +1612,16 @@ void initiateRouteDiscovery() {
     routeReq.messageType = MSG_TYPE_ROUTE_REQUEST;
     routeReq.sourceId = NODE_ID;
     routeReq.destinationId = GATEWAY_ID;
+    routeReq.senderId = NODE_ID;
+    routeReq.nextHopId = BROADCAST_ID;
     routeReq.hopCount = 0;
-    routeReq.messageId = messageCounter++;
+    routeReq.pathCost = 0;
+    routeReq.flags = 0;
+    routeReq.messageId = controlCounter++;
     
     LoRa.beginPacket();
     LoRa.write((uint8_t*)&routeReq, sizeof(LoRaMessage));
-    if (LoRa.endPacket()) {
+    if (transmitPacket()) {
         DEBUG_PRINTLN("Route request sent.");
         DEBUG_PRINTF("RSSI: %d, SNR: %.2f\n", 
                     LoRa.packetRssi(),
@@ -440,12 +1636,16 @@ void initiateRouteDiscovery() {
     lastRouteDiscovery = millis();
 }
 
-bool waitForAck(uint8_t messageId) {
+bool waitForAck(uint16_t messageId) {
     unsigned long startTime = millis();
     DEBUG_PRINTF("Waiting for ACK with ID: %d\n", messageId);
     
-    while (millis() - startTime < 5000) {
+    // Every hop there and back may wait for a neighbour's CAD
+    while (millis() - startTime < E2E_ACK_TIMEOUT + 2 * MAX_HOPS * LPL_HOP_DELAY) {
         int packetSize = LoRa.parsePacket();
+        if (packetSize > 0) {
+            noteFrameHeard();
+        }
         if (packetSize == sizeof(LoRaMessage)) {
             LoRaMessage ack;
             memset(&ack, 0, sizeof(LoRaMessage)); // Clear struktur
@@ -458,6 +1658,9 @@ bool waitForAck(uint8_t messageId) {
                 ack.messageId == messageId && 
                 ack.destinationId == NODE_ID) {
                 DEBUG_PRINTLN("Valid ACK received!");
+                if (ack.flags & MSG_FLAG_DOWNLINK) {
+                    handleDownlink(ack);
+                }
                 return true;
             } else {
                 DEBUG_PRINTF("Invalid ACK - Expected ID: %d, Got ID: %d, Type: %d\n",
@@ -470,122 +1673,712 @@ bool waitForAck(uint8_t messageId) {
     return false;
 }
 
-void sendAck(uint8_t messageId, uint8_t destinationId) {
+// Waits for the next hop to confirm it holds the frame, either with a LinkAck
+// or, in implicit mode, by overhearing it forward the frame. Anything else
+// heard meanwhile is dropped, as in waitForAck, but the wait is short.
+bool waitForLinkAck(uint8_t nextHopId, const LoRaMessage& msg) {
+    unsigned long startTime = millis();
+    while (millis() - startTime < LINK_ACK_TIMEOUT) {
+        int packetSize = LoRa.parsePacket();
+        if (packetSize > 0) {
+            noteFrameHeard();
+        }
+        if (packetSize == sizeof(LinkAck)) {
+            LinkAck linkAck;
+            LoRa.readBytes((uint8_t*)&linkAck, sizeof(LinkAck));
+            if (linkAck.messageType == MSG_TYPE_LINK_ACK &&
+                linkAck.senderId == nextHopId &&
+                linkAck.receiverId == NODE_ID &&
+                linkAck.sourceId == msg.sourceId &&
+                linkAck.messageId == msg.messageId) {
+                DEBUG_PRINTF("Link ACK from Node %d\n", nextHopId);
+                return true;
+            }
+        } else if (IMPLICIT_ACK && packetSize == sizeof(LoRaMessage)) {
+            LoRaMessage forward;
+            LoRa.readBytes((uint8_t*)&forward, sizeof(LoRaMessage));
+            if (forward.messageType == msg.messageType &&
+                forward.senderId == nextHopId &&
+                forward.sourceId == msg.sourceId &&
+                forward.messageId == msg.messageId &&
+                forward.hopCount == msg.hopCount + 1) {
+                DEBUG_PRINTF("Implicit ACK: Node %d forwarded the frame\n", nextHopId);
+                metrics.implicitAcks++;
+                return true;
+            }
+        }
+        delay(1);
+    }
+    DEBUG_PRINTF("Link ACK timeout from Node %d\n", nextHopId);
+    return false;
+}
+
+void sendLinkAck(const LoRaMessage& msg) {
+    LinkAck linkAck;
+    linkAck.messageType = MSG_TYPE_LINK_ACK;
+    linkAck.senderId = NODE_ID;
+    linkAck.receiverId = msg.senderId;
+    linkAck.sourceId = msg.sourceId;
+    linkAck.messageId = msg.messageId;
+
+    if (LPL_MODE) {
+        // The sender is awake and waiting, skip the wake-up preamble
+        LoRa.setPreambleLength(LORA_PREAMBLE_LENGTH);
+    }
+    LoRa.beginPacket();
+    LoRa.write((uint8_t*)&linkAck, sizeof(LinkAck));
+    transmitPacket();
+    if (LPL_MODE) {
+        LoRa.setPreambleLength(lplPreambleLength(activeConfig.spreadingFactor));
+    }
+}
+
+void sendAck(uint16_t messageId, uint8_t destinationId) {
+    RoutingEntry route;
     LoRaMessage ack;
     ack.messageType = MSG_TYPE_ACK;
     ack.sourceId = NODE_ID;
     ack.destinationId = destinationId;
+    ack.senderId = NODE_ID;
+    ack.nextHopId = findRoute(destinationId, route) ? route.nextHopId : BROADCAST_ID;
     ack.messageId = messageId;
     ack.hopCount = 0;
+    ack.pathCost = 0;
+    ack.flags = 0;
     
     LoRa.beginPacket();
     LoRa.write((uint8_t*)&ack, sizeof(LoRaMessage));
-    LoRa.endPacket();
+    transmitPacket();
 }
 
 void sendRouteResponse(uint8_t destinationId) {
+    RoutingEntry route;
     LoRaMessage routeResp;
     routeResp.messageType = MSG_TYPE_ROUTE_RESPONSE;
     routeResp.sourceId = NODE_ID;
     routeResp.destinationId = destinationId;
+    routeResp.senderId = NODE_ID;
+    routeResp.nextHopId = findRoute(destinationId, route) ? route.nextHopId : BROADCAST_ID;
     routeResp.hopCount = 0;
-    routeResp.messageId = messageCounter++;
+    routeResp.pathCost = 0;
+    routeResp.flags = 0;
+    routeResp.messageId = controlCounter++;
     
     LoRa.beginPacket();
     LoRa.write((uint8_t*)&routeResp, sizeof(LoRaMessage));
-    LoRa.endPacket();
+    transmitPacket();
 }
 
-void updateRoutingTable(uint8_t sourceId, uint8_t hopCount, int8_t rssi, float snr) {
-    bool routeFound = false;
-    
-    for (int i = 0; i < routingTableSize; i++) {
-        if (routingTable[i].destinationId == sourceId) {
-            if (hopCount < routingTable[i].hopCount || 
-                (hopCount == routingTable[i].hopCount && rssi > routingTable[i].lastRSSI)) {
-                routingTable[i].hopCount = hopCount;
-                routingTable[i].lastUpdate = millis();
-                routingTable[i].lastRSSI = rssi;
-                routingTable[i].lastSNR = snr;
+// hopCount is the distance to destinationId through nextHopId (1 for a
+// direct neighbour) and pathEtx the expected transmissions along it. A route
+// is replaced when the new path has a clearly lower ETX or the current one
+// has expired; the same next hop always refreshes its own entry. Paths that
+// do not win are kept as ranked fallbacks, and a replaced primary is demoted
+// to one.
+void updateRoutingTable(uint8_t destinationId, uint8_t nextHopId, uint8_t hopCount, float pathEtx, int8_t rssi, float snr) {
+    if (destinationId == NODE_ID || destinationId == BROADCAST_ID || hopCount > MAX_HOPS) {
+        return;
+    }
+
+    int slot = findRouteSlot(destinationId);
+    if (slot >= 0) {
+        bool expired = millis() - rtLastUpdate[slot] >= routeLifetime(destinationId);
+        if (nextHopId == rtNextHop[slot] || expired ||
+            pathEtx < rtPathEtx[slot] * (1.0 - ETX_HYSTERESIS)) {
+            if (nextHopId != rtNextHop[slot] || hopCount != rtHopCount[slot]) {
                 metrics.routingTableUpdates++;
             }
-            routeFound = true;
-            break;
+            if (nextHopId != rtNextHop[slot]) {
+                removeAlternative(slot, nextHopId);
+                if (!expired) {
+                    addAlternative(slot, rtNextHop[slot], rtHopCount[slot], rtPathEtx[slot], rtLastUpdate[slot]);
+                }
+            }
+            rtNextHop[slot] = nextHopId;
+            rtHopCount[slot] = hopCount;
+            rtPathEtx[slot] = pathEtx;
+            rtLastUpdate[slot] = millis();
+            rtRssi[slot] = rssi;
+            rtSnr[slot] = snr;
+        } else {
+            addAlternative(slot, nextHopId, hopCount, pathEtx, millis());
         }
+        return;
     }
-    
-    if (!routeFound && routingTableSize < 10) {
-        routingTable[routingTableSize].destinationId = sourceId;
-        routingTable[routingTableSize].hopCount = hopCount;
-        routingTable[routingTableSize].lastUpdate = millis();
-        routingTable[routingTableSize].lastRSSI = rssi;
-        routingTable[routingTableSize].lastSNR = snr;
-        routingTableSize++;
-        metrics.routingTableUpdates++;
-    }
-}
 
-void printRoutingTable() {
-    DEBUG_PRINTLN("\n=== Routing Table ===");
-    DEBUG_PRINTLN("Dest\tHops\tRSSI\tSNR\tAge(s)");
-    
-    for (int i = 0; i < routingTableSize; i++) {
-        unsigned long age = (millis() - routingTable[i].lastUpdate) / 1000;
-        DEBUG_PRINTF("%d\t%d\t%d\t%.1f\t%lu\n",
-            routingTable[i].destinationId,
-            routingTable[i].hopCount,
-            routingTable[i].lastRSSI,
-            routingTable[i].lastSNR,
-            age);
+    slot = insertRouteSlot(destinationId, pathEtx);
+    if (slot < 0) {
+        return;
+    }
+    rtNextHop[slot] = nextHopId;
+    rtHopCount[slot] = hopCount;
+    rtPathEtx[slot] = pathEtx;
+    rtLastUpdate[slot] = millis();
+    rtRssi[slot] = rssi;
+    rtSnr[slot] = snr;
+    metrics.routingTableUpdates++;
+
+    if (destinationId == GATEWAY_ID && gatewayRouteLost) {
+        unsigned long convergence = millis() - gatewayRouteLostAt;
+        gatewayRouteLost = false;
+        metrics.routeConvergences++;
+        metrics.lastConvergenceMs = convergence;
+        if (convergence > metrics.maxConvergenceMs) {
+            metrics.maxConvergenceMs = convergence;
+        }
+        DEBUG_PRINTF("Gateway route restored via %d after %lu ms\n", nextHopId, convergence);
     }
-    DEBUG_PRINTLN("==================");
-}
-
-void printDebugInfo() {
-    DEBUG_PRINTLN("\n=== Node Status ===");
-    DEBUG_PRINTF("Uptime: %lu seconds\n", metrics.uptimeSeconds);
-    DEBUG_PRINTF("Messages Sent: %lu\n", metrics.messagesSent);
-    DEBUG_PRINTF("Messages Received: %lu\n", metrics.messagesReceived);
-    DEBUG_PRINTF("Messages Forwarded: %lu\n", metrics.messagesForwarded);
-    DEBUG_PRINTF("Messages Failed: %lu\n", metrics.messagesFailed);
-    DEBUG_PRINTF("Last RSSI: %ld\n", metrics.lastRSSI);
-    DEBUG_PRINTF("Last SNR: %.2f\n", metrics.lastSNR);
-    DEBUG_PRINTF("Routing Table Updates: %lu\n", metrics.routingTableUpdates);
-    
-    printRoutingTable();
 }
 
-void updateMetrics() {
-    metrics.uptimeSeconds = millis() / 1000;
+void initRoutingTable() {
+    memset(rtDestination, ROUTE_SLOT_EMPTY, sizeof(rtDestination));
+    routingTableSize = 0;
 }
 
-void dataSensor(char* payload, int length) {
-    // Isi payload dengan data yang valid
-    
-    snprintf(payload, length, "R:%.2f,D:%.2f", rain_val, distance_val);
+int findRouteSlot(uint8_t destinationId) {
+    int slot = destinationId & (ROUTING_TABLE_SIZE - 1);
+    for (int probe = 0; probe < ROUTING_TABLE_SIZE; probe++) {
+        if (rtDestination[slot] == destinationId) {
+            return slot;
+        }
+        if (rtDestination[slot] == ROUTE_SLOT_EMPTY) {
+            return -1;
+        }
+        slot = (slot + 1) & (ROUTING_TABLE_SIZE - 1);
+    }
+    return -1;
 }
 
-void generateRandomData(char* payload, int length) {
-    // Generate random sensor values
-    rain_val = random(0, 10000) / 100.0;    // 0-100%
-    distance_val = random(0, 50000) / 100.0; // 0-500cm
-    
-    // Format the values into the payload string
-    snprintf(payload, length, "R:%.2f,D:%.2f", rain_val, distance_val);
+// Claims a slot for a new destination, evicting if the table is full.
+// Returns -1 when every candidate victim is a better route than pathEtx.
+int insertRouteSlot(uint8_t destinationId, float pathEtx) {
+    if (routingTableSize >= ROUTING_TABLE_CAPACITY) {
+        int victim = -1;
+        for (int i = 0; i < ROUTING_TABLE_SIZE; i++) {
+            if (rtDestination[i] == ROUTE_SLOT_EMPTY) {
+                continue;
+            }
+            if (millis() - rtLastUpdate[i] >= routeLifetime(rtDestination[i])) {
+                victim = i;
+                break;
+            }
+            if (rtDestination[i] == GATEWAY_ID || isActiveNextHop(rtDestination[i])) {
+                continue;
+            }
+            if (victim < 0 || rtPathEtx[i] > rtPathEtx[victim] ||
+                (rtPathEtx[i] == rtPathEtx[victim] && rtLastUpdate[i] < rtLastUpdate[victim])) {
+                victim = i;
+            }
+        }
+        bool victimExpired = victim >= 0 && millis() - rtLastUpdate[victim] >= routeLifetime(rtDestination[victim]);
+        if (victim < 0 || (!victimExpired && rtPathEtx[victim] <= pathEtx)) {
+            DEBUG_PRINTF("Routing table full, Node %d not added\n", destinationId);
+            return -1;
+        }
+        DEBUG_PRINTF("Routing table full, evicting Node %d\n", rtDestination[victim]);
+        removeRouteSlot(victim);
+        metrics.routesEvicted++;
+    }
+
+    int slot = destinationId & (ROUTING_TABLE_SIZE - 1);
+    while (rtDestination[slot] != ROUTE_SLOT_EMPTY) {
+        slot = (slot + 1) & (ROUTING_TABLE_SIZE - 1);
+    }
+    rtDestination[slot] = destinationId;
+    memset(rtAltNextHop[slot], ROUTE_SLOT_EMPTY, sizeof(rtAltNextHop[slot]));
+    routingTableSize++;
+    return slot;
 }
 
-bool findRoute(uint8_t destinationId, RoutingEntry& route) {
-    for (int i = 0; i < routingTableSize; i++) {
-        if (routingTable[i].destinationId == destinationId) {
-            if (millis() - routingTable[i].lastUpdate < 300000) {
-                route = routingTable[i];
-                return true;
+// Backward-shift deletion: later entries of the probe chain are moved into
+// the hole so lookups never need tombstones
+void removeRouteSlot(int slot) {
+    const int mask = ROUTING_TABLE_SIZE - 1;
+    int hole = slot;
+    for (int i = 1; i < ROUTING_TABLE_SIZE; i++) {
+        int next = (slot + i) & mask;
+        if (rtDestination[next] == ROUTE_SLOT_EMPTY) {
+            break;
+        }
+        int home = rtDestination[next] & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            rtDestination[hole] = rtDestination[next];
+            rtNextHop[hole] = rtNextHop[next];
+            rtHopCount[hole] = rtHopCount[next];
+            rtPathEtx[hole] = rtPathEtx[next];
+            rtLastUpdate[hole] = rtLastUpdate[next];
+            rtRssi[hole] = rtRssi[next];
+            rtSnr[hole] = rtSnr[next];
+            memcpy(rtAltNextHop[hole], rtAltNextHop[next], sizeof(rtAltNextHop[hole]));
+            memcpy(rtAltHopCount[hole], rtAltHopCount[next], sizeof(rtAltHopCount[hole]));
+            memcpy(rtAltPathEtx[hole], rtAltPathEtx[next], sizeof(rtAltPathEtx[hole]));
+            memcpy(rtAltLastUpdate[hole], rtAltLastUpdate[next], sizeof(rtAltLastUpdate[hole]));
+            hole = next;
+        }
+    }
+    rtDestination[hole] = ROUTE_SLOT_EMPTY;
+    routingTableSize--;
+}
+
+bool isActiveNextHop(uint8_t nodeId) {
+    for (int i = 0; i < ROUTING_TABLE_SIZE; i++) {
+        if (rtDestination[i] != ROUTE_SLOT_EMPTY && rtDestination[i] != nodeId && rtNextHop[i] == nodeId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void expireRoutes() {
+    int slot = 0;
+    while (slot < ROUTING_TABLE_SIZE) {
+        if (rtDestination[slot] != ROUTE_SLOT_EMPTY &&
+            millis() - rtLastUpdate[slot] >= routeLifetime(rtDestination[slot]) &&
+            !promoteAlternative(slot, routeLifetime(rtDestination[slot]))) {
+            // Removal may shift another entry into this slot, so re-check it
+            invalidateRoute(rtDestination[slot]);
+            metrics.routesExpired++;
+        } else {
+            slot++;
+        }
+    }
+}
+
+// Inserts or refreshes a fallback next hop, keeping the list sorted by ETX
+void addAlternative(int slot, uint8_t nextHopId, uint8_t hopCount, float pathEtx, unsigned long lastUpdate) {
+    if (nextHopId == rtNextHop[slot]) {
+        return;
+    }
+    removeAlternative(slot, nextHopId);
+
+    int pos = 0;
+    while (pos < ROUTE_ALTERNATIVES && rtAltNextHop[slot][pos] != ROUTE_SLOT_EMPTY &&
+           rtAltPathEtx[slot][pos] <= pathEtx) {
+        pos++;
+    }
+    if (pos >= ROUTE_ALTERNATIVES) {
+        return;
+    }
+    for (int i = ROUTE_ALTERNATIVES - 1; i > pos; i--) {
+        rtAltNextHop[slot][i] = rtAltNextHop[slot][i - 1];
+        rtAltHopCount[slot][i] = rtAltHopCount[slot][i - 1];
+        rtAltPathEtx[slot][i] = rtAltPathEtx[slot][i - 1];
+        rtAltLastUpdate[slot][i] = rtAltLastUpdate[slot][i - 1];
+    }
+    rtAltNextHop[slot][pos] = nextHopId;
+    rtAltHopCount[slot][pos] = hopCount;
+    rtAltPathEtx[slot][pos] = pathEtx;
+    rtAltLastUpdate[slot][pos] = lastUpdate;
+}
+
+void removeAlternative(int slot, uint8_t nextHopId) {
+    for (int i = 0; i < ROUTE_ALTERNATIVES; i++) {
+        if (rtAltNextHop[slot][i] != nextHopId) {
+            continue;
+        }
+        for (int j = i; j < ROUTE_ALTERNATIVES - 1; j++) {
+            rtAltNextHop[slot][j] = rtAltNextHop[slot][j + 1];
+            rtAltHopCount[slot][j] = rtAltHopCount[slot][j + 1];
+            rtAltPathEtx[slot][j] = rtAltPathEtx[slot][j + 1];
+            rtAltLastUpdate[slot][j] = rtAltLastUpdate[slot][j + 1];
+        }
+        rtAltNextHop[slot][ROUTE_ALTERNATIVES - 1] = ROUTE_SLOT_EMPTY;
+        return;
+    }
+}
+
+// Replaces the primary next hop with the best fallback heard within timeout.
+// The old primary is dropped, not demoted, since it is the one that failed.
+bool promoteAlternative(int slot, unsigned long timeout) {
+    while (rtAltNextHop[slot][0] != ROUTE_SLOT_EMPTY) {
+        uint8_t nextHopId = rtAltNextHop[slot][0];
+        uint8_t hopCount = rtAltHopCount[slot][0];
+        float pathEtx = rtAltPathEtx[slot][0];
+        unsigned long lastUpdate = rtAltLastUpdate[slot][0];
+        removeAlternative(slot, nextHopId);
+        if (millis() - lastUpdate >= timeout) {
+            continue;
+        }
+
+        DEBUG_PRINTF("Route to Node %d switched from %d to %d\n", rtDestination[slot], rtNextHop[slot], nextHopId);
+        rtNextHop[slot] = nextHopId;
+        rtHopCount[slot] = hopCount;
+        rtPathEtx[slot] = pathEtx;
+        rtLastUpdate[slot] = lastUpdate;
+        metrics.routeSwitches++;
+        metrics.routingTableUpdates++;
+        return true;
+    }
+    return false;
+}
+
+bool failoverRoute(uint8_t destinationId, uint8_t failedHopId) {
+    int slot = findRouteSlot(destinationId);
+    if (slot < 0 || rtNextHop[slot] != failedHopId) {
+        return false;
+    }
+    return promoteAlternative(slot, routeLifetime(destinationId));
+}
+
+LinkEstimate* findLink(uint8_t neighbourId, bool create) {
+    for (int i = 0; i < linkTableSize; i++) {
+        if (linkTable[i].neighbourId == neighbourId) {
+            return &linkTable[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    // Table full: reuse the neighbour heard least recently
+    int slot = linkTableSize;
+    if (linkTableSize < NEIGHBOUR_TABLE_SIZE) {
+        linkTableSize++;
+    } else {
+        slot = 0;
+        for (int i = 1; i < linkTableSize; i++) {
+            if (linkTable[i].lastHeard < linkTable[slot].lastHeard) {
+                slot = i;
             }
         }
     }
+    linkTable[slot].neighbourId = neighbourId;
+    linkTable[slot].ackSamples = 0;
+    linkTable[slot].ackRatio = 1.0;
+    linkTable[slot].lastHeard = 0;
+    return &linkTable[slot];
+}
+
+void updateLinkSignal(uint8_t neighbourId, int rssi, float snr) {
+    LinkEstimate* link = findLink(neighbourId, true);
+    if (link->lastHeard == 0) {
+        link->rssiAvg = rssi;
+        link->snrAvg = snr;
+    } else {
+        link->rssiAvg += ETX_ALPHA * (rssi - link->rssiAvg);
+        link->snrAvg += ETX_ALPHA * (snr - link->snrAvg);
+    }
+    link->lastHeard = millis();
+}
+
+void recordLinkResult(uint8_t neighbourId, bool acked) {
+    LinkEstimate* link = findLink(neighbourId, true);
+    if (link->ackSamples == 0) {
+        link->ackRatio = acked ? 1.0 : 0.0;
+    } else {
+        link->ackRatio += ETX_ALPHA * ((acked ? 1.0 : 0.0) - link->ackRatio);
+    }
+    if (link->ackSamples < ETX_ACK_SAMPLES) {
+        link->ackSamples++;
+    }
+}
+
+// Expected transmissions over one link. The signal-based prior maps the
+// RSSI and SNR margin above the demodulation limit onto a delivery ratio and
+// is blended out as ACK outcomes accumulate.
+float linkEtx(uint8_t neighbourId) {
+    LinkEstimate* link = findLink(neighbourId, false);
+    if (link == NULL) {
+        return 1.0 / ETX_MIN_PRR;
+    }
+
+    // Limits of the spreading factor in use, which an OTA config can change
+    int sfIndex = activeConfig.spreadingFactor - 7;
+    float rssiMargin = (link->rssiAvg - loraSensitivity[sfIndex]) / 15.0f;
+    float snrMargin = (link->snrAvg - loraSnrFloor[sfIndex]) / 10.0f;
+    float rssiPrr = constrain(rssiMargin, (float)ETX_MIN_PRR, 1.0f);
+    float snrPrr = constrain(snrMargin, (float)ETX_MIN_PRR, 1.0f);
+    float priorPrr = min(rssiPrr, snrPrr);
+
+    float weight = (float)link->ackSamples / ETX_ACK_SAMPLES;
+    float prr = weight * link->ackRatio + (1.0 - weight) * priorPrr;
+    if (prr < ETX_MIN_PRR) {
+        prr = ETX_MIN_PRR;
+    }
+    return 1.0 / prr;
+}
+
+uint8_t encodeEtx(float etx) {
+    float tenths = etx * 10.0 + 0.5;
+    return tenths >= ROUTE_COST_INFINITE ? ROUTE_COST_INFINITE - 1 : (uint8_t)tenths;
+}
+
+bool isDuplicate(const LoRaMessage& msg) {
+    unsigned long now = millis();
+    for (int i = 0; i < DEDUP_CACHE_SIZE; i++) {
+        const DedupEntry& entry = dedupCache[i];
+        if (entry.messageType == msg.messageType &&
+            entry.sourceId == msg.sourceId &&
+            entry.messageId == msg.messageId &&
+            entry.retry == (msg.flags & MSG_FLAG_RETRY_MASK) &&
+            now - entry.timestamp < DEDUP_TIMEOUT) {
+            metrics.dedupHits++;
+            return true;
+        }
+    }
+
+    // Miss: remember this key, overwriting the oldest slot
+    dedupCache[dedupNext].sourceId = msg.sourceId;
+    dedupCache[dedupNext].messageId = msg.messageId;
+    dedupCache[dedupNext].messageType = msg.messageType;
+    dedupCache[dedupNext].retry = msg.flags & MSG_FLAG_RETRY_MASK;
+    dedupCache[dedupNext].timestamp = now;
+    dedupNext = (dedupNext + 1) % DEDUP_CACHE_SIZE;
+    metrics.dedupMisses++;
+    return false;
+}
+
+void printRoutingTable() {
+    DEBUG_PRINTLN("\n=== Routing Table ===");
+    DEBUG_PRINTLN("Dest\tNext\tHops\tETX\tRSSI\tSNR\tAge(s)\tAlt");
+    
+    for (int i = 0; i < ROUTING_TABLE_SIZE; i++) {
+        if (rtDestination[i] == ROUTE_SLOT_EMPTY) {
+            continue;
+        }
+        unsigned long age = (millis() - rtLastUpdate[i]) / 1000;
+        DEBUG_PRINTF("%d\t%d\t%d\t%.1f\t%d\t%.1f\t%lu\t",
+            rtDestination[i],
+            rtNextHop[i],
+            rtHopCount[i],
+            rtPathEtx[i],
+            rtRssi[i],
+            rtSnr[i],
+            age);
+        for (int j = 0; j < ROUTE_ALTERNATIVES && rtAltNextHop[i][j] != ROUTE_SLOT_EMPTY; j++) {
+            DEBUG_PRINTF("%d(%.1f) ", rtAltNextHop[i][j], rtAltPathEtx[i][j]);
+        }
+        DEBUG_PRINTLN("");
+    }
+    DEBUG_PRINTLN("==================");
+}
+
+void printDebugInfo() {
+    DEBUG_PRINTLN("\n=== Node Status ===");
+    DEBUG_PRINTF("Uptime: %lu seconds\n", metrics.uptimeSeconds);
+    DEBUG_PRINTF("Messages Sent: %lu\n", metrics.messagesSent);
+    DEBUG_PRINTF("Messages Received: %lu\n", metrics.messagesReceived);
+    DEBUG_PRINTF("Messages Forwarded: %lu\n", metrics.messagesForwarded);
+    DEBUG_PRINTF("Messages Failed: %lu\n", metrics.messagesFailed);
+    DEBUG_PRINTF("Last RSSI: %ld\n", metrics.lastRSSI);
+    DEBUG_PRINTF("Last SNR: %.2f\n", metrics.lastSNR);
+    DEBUG_PRINTF("Routing Table Updates: %lu\n", metrics.routingTableUpdates);
+    DEBUG_PRINTF("Routing Table: %d/%d, Expired: %lu, Evicted: %lu\n",
+                routingTableSize, ROUTING_TABLE_CAPACITY, metrics.routesExpired, metrics.routesEvicted);
+    DEBUG_PRINTF("Route Switches: %lu\n", metrics.routeSwitches);
+    DEBUG_PRINTF("Beacons Sent: %lu, Suppressed: %lu, Trickle Resets: %lu\n",
+                metrics.beaconsSent, metrics.beaconsSuppressed, metrics.trickleResets);
+    DEBUG_PRINTF("Implicit ACKs: %lu\n", metrics.implicitAcks);
+    DEBUG_PRINTF("RREQ Rebroadcasts: %lu, Suppressed: %lu\n", metrics.rreqRebroadcasts, metrics.rreqSuppressed);
+    DEBUG_PRINTF("Config Version: %u, Pending: %d, Rejected: %lu, Fallbacks: %lu\n",
+                activeConfig.version, hasPendingConfig ? pendingConfig.version : 0, metrics.configRejected,
+                metrics.configFallbacks);
+    if (SLEEPY_LEAF) {
+        DEBUG_PRINTF("Wake Cycles: %lu, Awake: last %lu ms, avg %lu ms\n", metrics.wakeCycles, metrics.lastAwakeMs,
+                    metrics.wakeCycles ? (unsigned long)(metrics.totalAwakeMs / metrics.wakeCycles) : 0);
+        DEBUG_PRINTF("Average Current: %.3f mA (%lu power meter samples)\n",
+                    averageCurrent(), metrics.awakeCurrentSamples);
+    }
+    if (LPL_MODE) {
+        DEBUG_PRINTF("LPL Checks: %lu, Wakeups: %lu, False: %lu\n",
+                    metrics.lplChecks, metrics.lplWakeups, metrics.lplFalseWakeups);
+    }
+    DEBUG_PRINTF("Energy (J): TX %.3f, RX %.3f, CPU %.3f, SD %.3f, Sensors %.3f, Sleep %.3f\n",
+                energy.joules[ENERGY_TX], energy.joules[ENERGY_RX], energy.joules[ENERGY_CPU],
+                energy.joules[ENERGY_SD], energy.joules[ENERGY_SENSOR], energy.joules[ENERGY_SLEEP]);
+    DEBUG_PRINTF("Energy Calibration: %.2f\n", energy.calibration);
+    DEBUG_PRINTF("Distance Frames: %lu valid, %lu invalid\n",
+                distanceParser.framesValid, distanceParser.framesInvalid);
+    for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+        DEBUG_PRINTF("Filter %s: %lu spikes, %lu failed\n", sensorFields[i].name,
+                    sensorFilters[i].rejected, sensorFilters[i].failed);
+    }
+    if (SERIAL_PROFILE) {
+        DEBUG_PRINTF("Serial Profile: IRQ latency avg %.2f us, max %lu us, IRQ load %.1f%%\n",
+                    profileLatency(), (unsigned long)serialProfile.latencyMax, profileLoad());
+    }
+    DEBUG_PRINTF("Reports Suppressed: %lu\n", metrics.reportsSuppressed);
+    DEBUG_PRINTF("Payload Fields Dropped: %lu\n", metrics.payloadFieldsDropped);
+    DEBUG_PRINTF("Dedup Hits/Misses: %lu/%lu\n", metrics.dedupHits, metrics.dedupMisses);
+    DEBUG_PRINTF("Route Convergence: %lu events, last %lu ms, max %lu ms\n",
+                metrics.routeConvergences, metrics.lastConvergenceMs, metrics.maxConvergenceMs);
+    DEBUG_PRINTF("Data Transmissions: %lu (%.2f per delivered)\n", metrics.dataTransmissions,
+                metrics.messagesSent ? (float)metrics.dataTransmissions / metrics.messagesSent : 0.0);
+    
+    printRoutingTable();
+}
+
+void updateMetrics() {
+    metrics.uptimeSeconds = (clockBase + millis()) / 1000;
+    updateEnergy();
+}
+
+void dataSensor(char* payload, int length) {
+    // Isi payload dengan data yang valid
+    // Q: reading quality, only when a reading was held
+    // H: heartbeat interval in seconds so the gateway can judge staleness
+    // V: active configuration version
+    // The readings and Q always fit. H and V rarely change and the gateway
+    // keeps their last values, so they are left out rather than cut short.
+    static_assert(SENSOR_PAYLOAD_MAX + 3 + (2 * SENSOR_COUNT + 3) / 4 < sizeof(LoRaMessage::payload) - 1,
+                  "sensor fields and Q must fit in a DATA payload");
+    int written = encodeSensors(payload, length, sensorValues);
+    if (written < 0) {
+        return;
+    }
+    uint32_t quality = 0;
+    for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+        quality |= (uint32_t)sensorFilters[i].quality << (2 * i);
+    }
+    if (quality) {
+        written += snprintf(payload + written, length - written, ",Q:%lX", (unsigned long)quality);
+    }
+
+    char fields[2][16];
+    snprintf(fields[0], sizeof(fields[0]), ",H:%lu",
+             (unsigned long)(REPORT_BY_EXCEPTION ? HEARTBEAT_INTERVAL : activeConfig.sampleInterval) / 1000);
+    snprintf(fields[1], sizeof(fields[1]), ",V:%u", activeConfig.version);
+    for (uint8_t i = 0; i < 2; i++) {
+        int n = strlen(fields[i]);
+        if (written + n < length) {
+            strcpy(payload + written, fields[i]);
+            written += n;
+        } else {
+            metrics.payloadFieldsDropped++;
+        }
+    }
+}
+
+// Returns true when the new sample leaves the deadband around the last
+// reported value or changes faster than the channel's rate threshold.
+bool checkException(ExceptionChannel& channel, float value) {
+    unsigned long now = millis();
+    bool triggered = false;
+
+    if (fabs(value - channel.lastReported) >= channel.deadband) {
+        triggered = true;
+    }
+
+    // Over a window this long, reaching the rate threshold means moving at
+    // least one deadband
+    unsigned long window = (unsigned long)(channel.deadband / channel.rateThreshold * 60000.0);
+    if (!channel.hasSample) {
+        channel.rateBase = value;
+        channel.rateBaseTime = now;
+        channel.hasSample = true;
+    } else if (now - channel.rateBaseTime >= window && now != channel.rateBaseTime) {
+        float ratePerMinute = fabs(value - channel.rateBase) * 60000.0 / (now - channel.rateBaseTime);
+        if (ratePerMinute >= channel.rateThreshold) {
+            triggered = true;
+        }
+        channel.rateBase = value;
+        channel.rateBaseTime = now;
+    }
+    return triggered;
+}
+
+bool reportDue() {
+    // All channels are always evaluated so their rate history stays current
+    bool exception[SENSOR_COUNT];
+    bool anyException = false;
+    for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+        exception[i] = checkException(exceptionChannels[i], sensorValues[i]);
+        anyException = anyException || exception[i];
+    }
+
+    if (!REPORT_BY_EXCEPTION || !hasReported) {
+        return true;
+    }
+    if (millis() - lastReportTime >= HEARTBEAT_INTERVAL) {
+        DEBUG_PRINTLN("Heartbeat due");
+        return true;
+    }
+    if (anyException) {
+        DEBUG_PRINT("Exception report -");
+        for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+            DEBUG_PRINTF("%s %s: %s", i ? "," : "", sensorFields[i].name, exception[i] ? "yes" : "no");
+        }
+        DEBUG_PRINTLN("");
+        return true;
+    }
     return false;
 }
 
+void markReported() {
+    for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+        exceptionChannels[i].lastReported = sensorValues[i];
+    }
+    lastReportTime = millis();
+    hasReported = true;
+}
+
+void generateRandomData(char* payload, int length) {
+    // Generate random sensor values
+    sensorValues[SENSOR_RAIN] = random(0, 10000) / 100.0;    // 0-100%
+    sensorValues[SENSOR_DISTANCE] = random(0, 50000) / 100.0; // 0-500cm
+    
+    // Format the values into the payload string
+    encodeSensors(payload, length, sensorValues);
+}
+
+bool findRoute(uint8_t destinationId, RoutingEntry& route) {
+    int slot = findRouteSlot(destinationId);
+    if (slot < 0) {
+        return false;
+    }
+    unsigned long lifetime = routeLifetime(destinationId);
+    if (millis() - rtLastUpdate[slot] >= lifetime && !promoteAlternative(slot, lifetime)) {
+        return false;
+    }
+    route.destinationId = destinationId;
+    route.nextHopId = rtNextHop[slot];
+    route.hopCount = rtHopCount[slot];
+    route.lastUpdate = rtLastUpdate[slot];
+    route.lastRSSI = rtRssi[slot];
+    route.lastSNR = rtSnr[slot];
+    route.pathEtx = rtPathEtx[slot];
+    return true;
+}
+
+void invalidateRoute(uint8_t destinationId) {
+    int slot = findRouteSlot(destinationId);
+    if (slot < 0) {
+        return;
+    }
+    DEBUG_PRINTF("Route to Node %d via %d invalidated\n", destinationId, rtNextHop[slot]);
+    if (destinationId == GATEWAY_ID) {
+        gatewayRouteLost = true;
+        gatewayRouteLostAt = rtLastUpdate[slot];
+    }
+    removeRouteSlot(slot);
+    metrics.routingTableUpdates++;
+}
+
+void initSequence() {
+    preferences.begin("lora", false);
+    if (wokeFromSleep) {
+        // The reserved block in NVS is still ahead of the counter
+        messageCounter = sleepState.messageCounter;
+        seqReservedUntil = sleepState.seqReservedUntil;
+        return;
+    }
+    messageCounter = preferences.getUShort("seq", 0);
+    reserveSequenceBlock();
+    DEBUG_PRINTF("Sequence resumed at %u\n", messageCounter);
+}
+
+void reserveSequenceBlock() {
+    seqReservedUntil = messageCounter + SEQ_PERSIST_BLOCK;
+    preferences.putUShort("seq", seqReservedUntil);
+}
+
+uint16_t nextSequence() {
+    if (messageCounter == seqReservedUntil) {
+        reserveSequenceBlock();
+    }
+    return messageCounter++;
+}
+
 void resetLoRa() {
     DEBUG_PRINTLN("Resetting LoRa module...");
     digitalWrite(LORA_RST, LOW);
@@ -631,108 +2424,308 @@ void initSDCard() {
   }
 }
 
-void bacaRain() {
-//   Serial.println("Baca Rain jalan");
-  uint8_t id = 1; // Ubah tipe data menjadi uint8_t
+bool bacaRain(float& value, unsigned long since) {
+    // Only a lookup, the poll table reads the sensor
+    return modbusValue(RAIN_POINT, value) && modbusFresh(RAIN_POINT, since);
+}
 
-  // Kirim permintaan baca data ke RS485
-  uint8_t buffer[] = { id, 0x03, 0x01, 0x05, 0x00, 0x01, 0x00, 0x00 };
-  uint16_t crc = calculateCRC(buffer, sizeof(buffer) - 2);
-  buffer[sizeof(buffer) - 2] = crc & 0xFF;  // LSB
-  buffer[sizeof(buffer) - 1] = crc >> 8;    // MSB
+void modbusRefreshWait() {
+    // Blocking variant for the sleepy leaf, still returns as soon as the
+    // last reply is complete
+    modbusRefresh();
+    while (!modbusRefreshDone()) {
+        modbusPoll();
+        modbusSchedule();
+        delay(1);
+    }
+}
 
-  // Kirim permintaan ke RS485
-  mySerial.write(buffer, sizeof(buffer));
+bool modbusReadRegisters(uint8_t slaveId, uint8_t function, uint16_t startRegister, uint16_t count) {
+    if (modbus.state == MODBUS_WAITING) {
+        return false;
+    }
+    uint8_t buffer[8] = { slaveId, function,
+                          (uint8_t)(startRegister >> 8), (uint8_t)(startRegister & 0xFF),
+                          (uint8_t)(count >> 8), (uint8_t)(count & 0xFF), 0x00, 0x00 };
+    uint16_t crc = crc16Modbus(buffer, sizeof(buffer) - 2);
+    buffer[sizeof(buffer) - 2] = crc & 0xFF;  // LSB
+    buffer[sizeof(buffer) - 1] = crc >> 8;    // MSB
+
+    // Sisa balasan lama dibuang
+    while (modbusBus->available()) {
+        modbusBus->read();
+    }
+    modbusRxIdle = false;
 
-  digitalWrite(enTxPin, LOW);  // Set ke RX mode untuk menerima balasan
+    // Driver aktif selama seluruh frame terkirim, lalu bus dilepas untuk balasan
+    digitalWrite(enTxPin, HIGH);
+    modbusBus->write(buffer, sizeof(buffer));
+    modbusBus->flush();
+    digitalWrite(enTxPin, LOW);
+
+    modbus.state = MODBUS_WAITING;
+    modbus.slaveId = slaveId;
+    modbus.function = function;
+    modbus.expectedLength = 5 + 2 * count;    // id, function, byte count, data, CRC
+    modbus.length = 0;
+    modbus.startTime = millis();
+    modbus.lastByteTime = micros();
+    return true;
+}
 
-  // Menunggu respons dari RS485
-  unsigned long timeLimit = millis();
-  while (millis() - timeLimit < 500) {  // Tunggu hingga 500ms
-    if (mySerial.available()) {
-      byte responseHeader[8];
+void modbusPoll() {
+    if (modbus.state != MODBUS_WAITING) {
+        return;
+    }
+    // Read the flag first: once it is up, the whole frame is in the buffer
+    bool rxIdle = modbusRxIdle;
+    while (modbusBus->available() && modbus.length < MODBUS_FRAME_SIZE) {
+        modbus.response[modbus.length++] = modbusBus->read();
+        modbus.lastByteTime = micros();
+    }
+    if (MODBUS_UART == SENSOR_UART_SOFTWARE) {
+        rxIdle = micros() - modbus.lastByteTime >= MODBUS_T35_US;
+    }
 
-      // Membaca 8 byte dari RS485
-      mySerial.readBytes(responseHeader, 8);
+    // Exception responses are id, function | 0x80, code and CRC
+    uint8_t expected = modbus.expectedLength;
+    if (modbus.length >= 2 && (modbus.response[1] & 0x80)) {
+        expected = 5;
+    }
+    bool complete = modbus.length >= expected || (modbus.length > 0 && rxIdle);
+    if (complete) {
+        modbus.state = modbusValidate() ? MODBUS_DONE : MODBUS_FAILED;
+    } else if (millis() - modbus.startTime >= MODBUS_RESPONSE_TIMEOUT) {
+        DEBUG_PRINTF("Modbus: no response from slave %d\n", modbus.slaveId);
+        modbus.state = MODBUS_FAILED;
+    }
+    if (modbus.state != MODBUS_WAITING) {
+        chargeEnergy(ENERGY_SENSOR, (millis() - modbus.startTime) / 1000.0, ENERGY_SENSOR_CURRENT);
+    }
+}
 
-      // Tampilkan balasan byte per byte di Serial Monitor
-    //   Serial.println("Balasan dari RS485:");
-      for (int i = 0; i < 8; i++) {
-        // Serial.print("Byte ");
-        // Serial.print(i);
-        // Serial.print(": 0x");
-        // Serial.println(responseHeader[i], HEX);  // Tampilkan dalam format heksadesimal
-      }
+bool modbusValidate() {
+    if (modbus.length < 5) {
+        DEBUG_PRINTF("Modbus: short frame (%d bytes)\n", modbus.length);
+        return false;
+    }
+    if (!crc16ModbusCheck(modbus.response, modbus.length)) {
+        DEBUG_PRINTLN("Modbus: CRC mismatch");
+        return false;
+    }
+    if (modbus.response[0] != modbus.slaveId) {
+        DEBUG_PRINTF("Modbus: reply from slave %d, expected %d\n", modbus.response[0], modbus.slaveId);
+        return false;
+    }
+    if (modbus.response[1] == (modbus.function | 0x80)) {
+        DEBUG_PRINTF("Modbus: exception %d\n", modbus.response[2]);
+        return false;
+    }
+    return modbus.response[1] == modbus.function && modbus.length == modbus.expectedLength &&
+           modbus.response[2] == modbus.expectedLength - 5;
+}
 
-      // Jika balasan sesuai (misal, id dan kode fungsi benar)
-      if (responseHeader[0] == id && responseHeader[1] == 0x03 && responseHeader[2] == 0x02) {
-        // Gabungkan byte 3 dan byte 4 menjadi satu nilai 16-bit
-        uint16_t rawValue = (responseHeader[3] << 8) | responseHeader[4];
+void buildModbusBlocks() {
+    // Sort by slave, function and register so mergeable points are adjacent
+    uint8_t order[MODBUS_POINT_COUNT];
+    for (uint8_t i = 0; i < MODBUS_POINT_COUNT; i++) {
+        uint8_t j = i;
+        const ModbusPoint& point = modbusPoints[i];
+        while (j > 0) {
+            const ModbusPoint& prev = modbusPoints[order[j - 1]];
+            if (prev.slaveId < point.slaveId ||
+                (prev.slaveId == point.slaveId && (prev.function < point.function ||
+                 (prev.function == point.function && prev.startRegister <= point.startRegister)))) {
+                break;
+            }
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
 
-        // Simpan nilai rawValue sebagai int (tidak perlu pembagian karena ingin hasil integer)
-        rain_val = rawValue;
+    modbusBlockCount = 0;
+    for (uint8_t i = 0; i < MODBUS_POINT_COUNT; i++) {
+        const ModbusPoint& point = modbusPoints[order[i]];
+        uint16_t end = point.startRegister + MODBUS_TYPE_REGISTERS(point.type);
+        ModbusBlock* block = modbusBlockCount ? &modbusBlocks[modbusBlockCount - 1] : NULL;
+        bool merge = block && block->slaveId == point.slaveId && block->function == point.function &&
+                     point.startRegister <= block->startRegister + block->count + MODBUS_MERGE_GAP &&
+                     end - block->startRegister <= MODBUS_MAX_REGISTERS;
+        if (merge) {
+            if (end > block->startRegister + block->count) {
+                block->count = end - block->startRegister;
+            }
+            if (point.period && (!block->period || point.period < block->period)) {
+                block->period = point.period;
+            }
+        } else {
+            block = &modbusBlocks[modbusBlockCount++];
+            block->slaveId = point.slaveId;
+            block->function = point.function;
+            block->startRegister = point.startRegister;
+            block->count = end - point.startRegister;
+            block->period = point.period;
+            block->lastPoll = millis();
+            block->refresh = false;
+        }
+        modbusPointBlock[order[i]] = modbusBlockCount - 1;
+    }
+    DEBUG_PRINTF("Modbus: %d points in %d transactions\n", (int)MODBUS_POINT_COUNT, modbusBlockCount);
+}
 
-        // Tampilkan nilai Rain di Serial Monitor
-        // Serial.print("Nilai Rain (int): ");
-        Serial.println(rain_val);
-      }
+void modbusSchedule() {
+    if (modbus.state == MODBUS_WAITING) {
+        return;
+    }
+    if (modbusActiveBlock >= 0) {
+        modbusPublish(modbusActiveBlock, modbus.state == MODBUS_DONE);
+        modbusActiveBlock = -1;
+        modbus.state = MODBUS_IDLE;
+        modbusBusFreeAt = micros();
+    }
+    // The bus must stay silent for 3.5 characters between frames
+    if (micros() - modbusBusFreeAt < MODBUS_T35_US) {
+        return;
     }
-  }
 
-  digitalWrite(enTxPin, HIGH);  // Set ke TX mode
+    // Round robin, another slave first so one instrument cannot hog the bus
+    int next = -1;
+    for (uint8_t pass = 0; pass < 2 && next < 0; pass++) {
+        for (uint8_t i = 0; i < modbusBlockCount; i++) {
+            ModbusBlock& block = modbusBlocks[i];
+            bool due = block.refresh || (block.period && millis() - block.lastPoll >= block.period);
+            if (due && (pass == 1 || block.slaveId != modbusLastSlave)) {
+                next = i;
+                break;
+            }
+        }
+    }
+    if (next < 0) {
+        return;
+    }
+    ModbusBlock& block = modbusBlocks[next];
+    if (modbusReadRegisters(block.slaveId, block.function, block.startRegister, block.count)) {
+        block.lastPoll = millis();
+        modbusActiveBlock = next;
+        modbusLastSlave = block.slaveId;
+    }
+}
 
-//   Serial.println("Baca Rain Selesai");
+void modbusPublish(int block, bool success) {
+    modbusBlocks[block].refresh = false;
+    for (uint8_t i = 0; i < MODBUS_POINT_COUNT; i++) {
+        if (modbusPointBlock[i] != block) {
+            continue;
+        }
+        if (!success) {
+            // Previous value is kept
+            modbusSamples[i].failures++;
+            continue;
+        }
+        const ModbusPoint& point = modbusPoints[i];
+        const uint8_t* data = &modbus.response[3 + 2 * (point.startRegister - modbusBlocks[block].startRegister)];
+        uint16_t high = (data[0] << 8) | data[1];
+        float raw = high;
+        if (point.type == MODBUS_S16) {
+            raw = (int16_t)high;
+        } else if (point.type == MODBUS_U32 || point.type == MODBUS_F32) {
+            uint32_t word = ((uint32_t)high << 16) | (data[2] << 8) | data[3];
+            if (point.type == MODBUS_U32) {
+                raw = word;
+            } else {
+                memcpy(&raw, &word, sizeof(raw));
+            }
+        }
+        modbusSamples[i].value = raw * point.scale;
+        modbusSamples[i].updatedAt = millis();
+        modbusSamples[i].valid = true;
+    }
 }
 
-void bacaDistance() {
-    // Serial.println("Baca Distance jalan");
-  
-    unsigned long startTime = millis(); // Catat waktu saat mulai membaca data
-  
-    // Tunggu sampai data tersedia, dengan batas waktu 2 detik
-    while (mySerial1.available() < 4) {
-      if (millis() - startTime >= 2000) { // Jika waktu sudah lebih dari 2 detik
+void modbusRefresh() {
+    for (uint8_t i = 0; i < modbusBlockCount; i++) {
+        modbusBlocks[i].refresh = true;
+    }
+}
+
+bool modbusRefreshDone() {
+    for (uint8_t i = 0; i < modbusBlockCount; i++) {
+        if (modbusBlocks[i].refresh) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool modbusValue(uint8_t point, float& value) {
+    // Leaves value untouched until the point has been read once
+    if (!modbusSamples[point].valid) {
+        return false;
+    }
+    value = modbusSamples[point].value;
+    return true;
+}
+
+bool modbusFresh(uint8_t point, unsigned long since) {
+    // A failed read keeps the previous value, so check it was read since then
+    return modbusSamples[point].valid && (long)(modbusSamples[point].updatedAt - since) >= 0;
+}
+
+bool bacaDistance(float& value, unsigned long since) {
+    // Only a lookup, parseDistance() runs from loop(). The sensor streams,
+    // so any reading within DISTANCE_MAX_AGE counts, whatever since says
+    if (!distanceCurrent()) {
         Serial.println("ERROR: Timeout, no data received");
-        return; // Keluar dari fungsi
-      }
+        return false;
     }
-  
-    // Baca data sebanyak 4 byte
-    for (int i = 0; i < 4; i++) {
-      data[i] = mySerial1.read();
+    value = distanceParser.latest;
+    return true;
+}
+
+void parseDistance() {
+    while (distanceBus->available()) {
+        parseDistanceByte(distanceBus->read());
     }
-  
-    // Cek jika byte pertama adalah 0xff
-    if (data[0] == 0xff) {
-      int sum = (data[0] + data[1] + data[2]) & 0x00FF;  // Hitung checksum
-      if (sum == data[3]) {  // Jika checksum sesuai
-        float distance;
-        distance = (data[1] << 8) + data[2];  // Hitung jarak
-        distance_val = distance/10;
-        if (distance > 280) {  // Jika jarak di atas ambang batas 28 cm
-            
-        //   Serial.print("distance = ");
-        //   Serial.print(distance / 10);  // Konversi ke cm
-        //   Serial.println(" cm");
-        } else {
-        //   Serial.println("Below the lower limit");
-        }
-      } else {
-        // Serial.println("ERROR: Checksum mismatch");
-      }
-    } else {
-    //   Serial.println("ERROR: Invalid start byte");
+}
+
+void parseDistanceByte(uint8_t value) {
+    if (distanceParser.length == 0 && value != DISTANCE_HEADER) {
+        return;
     }
-  
-    // Flush untuk memastikan buffer bersih
-    while (mySerial1.available()) {
-      mySerial1.read();
+    distanceParser.frame[distanceParser.length++] = value;
+    if (distanceParser.length < sizeof(distanceParser.frame)) {
+        return;
     }
-  
-    // Serial.println("Baca Distance selesai");
+
+    uint8_t* frame = distanceParser.frame;
+    uint8_t sum = frame[0] + frame[1] + frame[2];  // Hitung checksum
+    if (sum == frame[3]) {
+        // Hitung jarak, mm ke cm
+        distanceParser.latest = ((frame[1] << 8) + frame[2]) / 10.0;
+        distanceParser.updatedAt = millis();
+        distanceParser.valid = true;
+        distanceParser.framesValid++;
+        distanceParser.length = 0;
+        return;
+    }
+
+    // Misaligned or corrupted: restart at the next 0xFF inside this frame
+    distanceParser.framesInvalid++;
+    uint8_t start = 1;
+    while (start < sizeof(distanceParser.frame) && frame[start] != DISTANCE_HEADER) {
+        start++;
+    }
+    distanceParser.length = sizeof(distanceParser.frame) - start;
+    memmove(frame, frame + start, distanceParser.length);
+}
+
+bool distanceCurrent() {
+    return distanceParser.valid && millis() - distanceParser.updatedAt < DISTANCE_MAX_AGE;
 }
 
 void DatalogNodeStatus() {
+    unsigned long sdStart = micros();
     DateTime now = myRTC.now();
 
     // Mendapatkan nilai bulan dengan format dua digit
@@ -770,15 +2763,58 @@ void DatalogNodeStatus() {
         myFile10.printf("Last RSSI: %d\n", metrics.lastRSSI);
         myFile10.printf("Last SNR: %.2f\n", metrics.lastSNR);
         myFile10.printf("Routing Table Updates: %lu\n", metrics.routingTableUpdates);
+        myFile10.printf("Routing Table: %d/%d, Expired: %lu, Evicted: %lu\n",
+                        routingTableSize, ROUTING_TABLE_CAPACITY, metrics.routesExpired, metrics.routesEvicted);
+        myFile10.printf("Route Switches: %lu\n", metrics.routeSwitches);
+        myFile10.printf("Beacons Sent: %lu, Suppressed: %lu, Trickle Resets: %lu\n",
+                        metrics.beaconsSent, metrics.beaconsSuppressed, metrics.trickleResets);
+        myFile10.printf("Implicit ACKs: %lu\n", metrics.implicitAcks);
+        myFile10.printf("RREQ Rebroadcasts: %lu, Suppressed: %lu\n", metrics.rreqRebroadcasts, metrics.rreqSuppressed);
+        myFile10.printf("Config Version: %u, Pending: %d, Rejected: %lu, Fallbacks: %lu\n",
+                        activeConfig.version, hasPendingConfig ? pendingConfig.version : 0, metrics.configRejected,
+                        metrics.configFallbacks);
+        if (SLEEPY_LEAF) {
+            myFile10.printf("Wake Cycles: %lu, Awake: last %lu ms, avg %lu ms\n", metrics.wakeCycles, metrics.lastAwakeMs,
+                            metrics.wakeCycles ? (unsigned long)(metrics.totalAwakeMs / metrics.wakeCycles) : 0);
+            myFile10.printf("Average Current: %.3f mA (%lu power meter samples)\n",
+                            averageCurrent(), metrics.awakeCurrentSamples);
+        }
+        if (LPL_MODE) {
+            myFile10.printf("LPL Checks: %lu, Wakeups: %lu, False: %lu\n",
+                            metrics.lplChecks, metrics.lplWakeups, metrics.lplFalseWakeups);
+        }
+        myFile10.printf("Energy (J): TX %.3f, RX %.3f, CPU %.3f, SD %.3f, Sensors %.3f, Sleep %.3f\n",
+                        energy.joules[ENERGY_TX], energy.joules[ENERGY_RX], energy.joules[ENERGY_CPU],
+                        energy.joules[ENERGY_SD], energy.joules[ENERGY_SENSOR], energy.joules[ENERGY_SLEEP]);
+        myFile10.printf("Energy Calibration: %.2f\n", energy.calibration);
+        myFile10.printf("Distance Frames: %lu valid, %lu invalid\n",
+                        distanceParser.framesValid, distanceParser.framesInvalid);
+        for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+            myFile10.printf("Filter %s: %lu spikes, %lu failed\n", sensorFields[i].name,
+                            sensorFilters[i].rejected, sensorFilters[i].failed);
+        }
+        if (SERIAL_PROFILE) {
+            myFile10.printf("Serial Profile: IRQ latency avg %.2f us, max %lu us, IRQ load %.1f%%\n",
+                            profileLatency(), (unsigned long)serialProfile.latencyMax, profileLoad());
+        }
+        myFile10.printf("Reports Suppressed: %lu\n", metrics.reportsSuppressed);
+        myFile10.printf("Payload Fields Dropped: %lu\n", metrics.payloadFieldsDropped);
+        myFile10.printf("Dedup Hits/Misses: %lu/%lu\n", metrics.dedupHits, metrics.dedupMisses);
+        myFile10.printf("Route Convergence: %lu events, last %lu ms, max %lu ms\n",
+                        metrics.routeConvergences, metrics.lastConvergenceMs, metrics.maxConvergenceMs);
+        myFile10.printf("Data Transmissions: %lu (%.2f per delivered)\n", metrics.dataTransmissions,
+                        metrics.messagesSent ? (float)metrics.dataTransmissions / metrics.messagesSent : 0.0);
         myFile10.println("==================");
 
         myFile10.close();
     } else {
         Serial.println("error opening file for writing");
     }
+    chargeEnergy(ENERGY_SD, (micros() - sdStart) / 1e6, ENERGY_SD_CURRENT);
 }
 
 void DatalogRoutingTables() {
+    unsigned long sdStart = micros();
     DateTime now = myRTC.now();
 
     // Mendapatkan nilai bulan dengan format dua digit
@@ -808,17 +2844,26 @@ void DatalogRoutingTables() {
 
         // Write routing table header
         myFile10.println("=== Routing Table ===");
-        myFile10.println("Dest\tHops\tRSSI\tSNR\tAge(s)");
+        myFile10.println("Dest\tNext\tHops\tETX\tRSSI\tSNR\tAge(s)\tAlt");
 
         // Write routing table entries
-        for (int i = 0; i < routingTableSize; i++) {
-            unsigned long age = (millis() - routingTable[i].lastUpdate) / 1000;
-            myFile10.printf("%d\t%d\t%d\t%.1f\t%lu\n",
-                routingTable[i].destinationId,
-                routingTable[i].hopCount,
-                routingTable[i].lastRSSI,
-                routingTable[i].lastSNR,
+        for (int i = 0; i < ROUTING_TABLE_SIZE; i++) {
+            if (rtDestination[i] == ROUTE_SLOT_EMPTY) {
+                continue;
+            }
+            unsigned long age = (millis() - rtLastUpdate[i]) / 1000;
+            myFile10.printf("%d\t%d\t%d\t%.1f\t%d\t%.1f\t%lu\t",
+                rtDestination[i],
+                rtNextHop[i],
+                rtHopCount[i],
+                rtPathEtx[i],
+                rtRssi[i],
+                rtSnr[i],
                 age);
+            for (int j = 0; j < ROUTE_ALTERNATIVES && rtAltNextHop[i][j] != ROUTE_SLOT_EMPTY; j++) {
+                myFile10.printf("%d(%.1f) ", rtAltNextHop[i][j], rtAltPathEtx[i][j]);
+            }
+            myFile10.println();
         }
         myFile10.println("==================");
         myFile10.println();
@@ -827,9 +2872,11 @@ void DatalogRoutingTables() {
     } else {
         Serial.println("error opening file for writing");
     }
+    chargeEnergy(ENERGY_SD, (micros() - sdStart) / 1e6, ENERGY_SD_CURRENT);
 }
 
 void DatalogError() {
+    unsigned long sdStart = micros();
     DateTime now = myRTC.now();
 
     // Mendapatkan nilai bulan dengan format dua digit
@@ -857,12 +2904,7 @@ void DatalogError() {
         myFile10.print(now.getSecond(), DEC);
         myFile10.print(", ");
         myFile10.print("Failed to send message: ");
-        myFile10.print("Rain: ");
-        myFile10.print(rain_val);
-        myFile10.print(" mm, ");
-        myFile10.print("Distance: ");
-        myFile10.print(distance_val);
-        myFile10.print(" cm, ");
+        printSensors(myFile10);
         myFile10.print("RSSI: ");
         myFile10.print(metrics.lastRSSI);
         myFile10.print(", SNR: "); 
@@ -878,9 +2920,11 @@ void DatalogError() {
     } else {
         Serial.println("error");
     }
+    chargeEnergy(ENERGY_SD, (micros() - sdStart) / 1e6, ENERGY_SD_CURRENT);
 }
 
 void Datalog() {
+    unsigned long sdStart = micros();
     DateTime now = myRTC.now();
 
     // Mendapatkan nilai bulan dengan format dua digit
@@ -907,12 +2951,7 @@ void Datalog() {
         myFile10.print(":");
         myFile10.print(now.getSecond(), DEC);
         myFile10.print(", ");
-        myFile10.print("Rain: ");
-        myFile10.print(rain_val);
-        myFile10.print(" mm, ");
-        myFile10.print("Distance: ");
-        myFile10.print(distance_val);
-        myFile10.print(" cm, ");
+        printSensors(myFile10);
         myFile10.print("RSSI: ");
         myFile10.print(metrics.lastRSSI);
         myFile10.print(", SNR: "); 
@@ -928,6 +2967,7 @@ void Datalog() {
     } else {
         Serial.println("error");
     }
+    chargeEnergy(ENERGY_SD, (micros() - sdStart) / 1e6, ENERGY_SD_CURRENT);
 }
 
 void ledFunction() {
@@ -940,4 +2980,677 @@ void ledFunction() {
     FastLED.show();
 }
 // ===================================================
-// End of existing function code
\ No newline at end of file
+// End of existing function code
+
+void loadConfig() {
+    NetworkConfig stored;
+    if (preferences.isKey("cfg") &&
+        preferences.getBytes("cfg", &stored, sizeof(NetworkConfig)) == sizeof(NetworkConfig)) {
+        activeConfig = stored;
+    }
+    if (preferences.isKey("cfg_next") &&
+        preferences.getBytes("cfg_next", &stored, sizeof(NetworkConfig)) == sizeof(NetworkConfig)) {
+        pendingConfig = stored;
+        hasPendingConfig = true;
+    }
+    if (preferences.isKey("cfg_good") &&
+        preferences.getBytes("cfg_good", &stored, sizeof(NetworkConfig)) == sizeof(NetworkConfig)) {
+        fallbackConfig = stored;
+        fallbackArmed = true;
+    }
+    DEBUG_PRINTF("Config version %u loaded\n", activeConfig.version);
+}
+
+void loadDownlinkState() {
+    // Deep sleep keeps it in sleepState instead
+    if (!wokeFromSleep && preferences.isKey("dl_reboot")) {
+        lastDownlinkId = preferences.getUShort("dl_reboot", 0);
+        hasDownlinkId = true;
+        DEBUG_PRINTF("Downlink %u (REBOOT) already executed\n", lastDownlinkId);
+    }
+}
+
+void loadConfigKey() {
+    File keyFile = SD.open(CONFIG_KEY_FILE);
+    if (keyFile) {
+        String key = keyFile.readStringUntil('\n');
+        keyFile.close();
+        key.trim();
+        if (key.length() > 0 && key.length() <= CONFIG_KEY_MAX && preferences.getString("cfg_key") != key) {
+            preferences.putString("cfg_key", key);
+        }
+    }
+    String key = preferences.getString("cfg_key");
+    strncpy(configKey, key.c_str(), CONFIG_KEY_MAX);
+    configKey[CONFIG_KEY_MAX] = '\0';
+    if (configKey[0] == '\0') {
+        DEBUG_PRINTLN("No config key, OTA config disabled");
+    }
+}
+
+void signConfig(const NetworkConfig& config, uint8_t* signature) {
+    uint8_t mac[32];
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                    (const uint8_t*)configKey, strlen(configKey),
+                    (const uint8_t*)&config, offsetof(NetworkConfig, signature), mac);
+    memcpy(signature, mac, CONFIG_SIGNATURE_SIZE);
+}
+
+// Returns true when the frame is signed with our key and newer than the
+// active config, so worth relaying; it is only applied if addressed to us
+bool receiveConfig(const LoRaMessage& msg) {
+    static_assert(sizeof(NetworkConfig) <= sizeof(msg.payload), "NetworkConfig must fit in a payload");
+    NetworkConfig config;
+    memcpy(&config, msg.payload, sizeof(NetworkConfig));
+
+    uint8_t signature[CONFIG_SIGNATURE_SIZE];
+    signConfig(config, signature);
+    if (configKey[0] == '\0' ||
+        memcmp(signature, config.signature, CONFIG_SIGNATURE_SIZE) != 0 ||
+        config.target != msg.destinationId) {
+        DEBUG_PRINTF("Config v%u rejected\n", config.version);
+        metrics.configRejected++;
+        return false;
+    }
+    // Versions only move forward, which also stops replays
+    if (config.version <= activeConfig.version) {
+        return false;
+    }
+    if (msg.destinationId != NODE_ID && msg.destinationId != BROADCAST_ID) {
+        return true;
+    }
+
+    if (config.spreadingFactor < 7 || config.spreadingFactor > 12 ||
+        config.txPower < 2 || config.txPower > 20 ||
+        config.sampleInterval < 1000 || config.debugInterval < 1000 ||
+        (config.applyAt == 0 && radioDiffers(config, activeConfig))) {
+        DEBUG_PRINTF("Config v%u rejected\n", config.version);
+        metrics.configRejected++;
+        return false;
+    }
+    if (hasPendingConfig && config.version <= pendingConfig.version) {
+        return true;
+    }
+    pendingConfig = config;
+    hasPendingConfig = true;
+    preferences.putBytes("cfg_next", &pendingConfig, sizeof(NetworkConfig));
+    DEBUG_PRINTF("Config v%u accepted, applies at %lu\n", config.version, (unsigned long)config.applyAt);
+    return true;
+}
+
+void checkPendingConfig() {
+    if ((!hasPendingConfig && !fallbackArmed) || millis() - lastConfigCheck < CONFIG_CHECK_INTERVAL) {
+        return;
+    }
+    lastConfigCheck = millis();
+    uint32_t now = myRTC.now().unixtime();
+    if (hasPendingConfig && (pendingConfig.applyAt == 0 || now >= pendingConfig.applyAt)) {
+        if (radioDiffers(pendingConfig, activeConfig)) {
+            fallbackConfig = activeConfig;
+            fallbackArmed = true;
+            preferences.putBytes("cfg_good", &fallbackConfig, sizeof(NetworkConfig));
+        }
+        applyConfig(pendingConfig);
+    }
+    if (fallbackArmed && now >= activeConfig.applyAt +
+               max((uint32_t)CONFIG_FALLBACK_TIME, 3 * activeConfig.sampleInterval / 1000)) {
+        // Nobody switched with us
+        DEBUG_PRINTF("Nothing heard on SF%d, back to config v%u\n",
+                    activeConfig.spreadingFactor, fallbackConfig.version);
+        fallbackArmed = false;
+        preferences.remove("cfg_good");
+        metrics.configFallbacks++;
+        applyConfig(fallbackConfig);
+    }
+}
+
+bool radioDiffers(const NetworkConfig& a, const NetworkConfig& b) {
+    return a.spreadingFactor != b.spreadingFactor || a.txPower != b.txPower;
+}
+
+// Any frame received proves the radio settings are shared with a neighbour
+void noteFrameHeard() {
+    if (fallbackArmed) {
+        fallbackArmed = false;
+        preferences.remove("cfg_good");
+        DEBUG_PRINTF("Config v%u confirmed on air\n", activeConfig.version);
+    }
+}
+
+void applyConfig(const NetworkConfig& config) {
+    bool radioChanged = radioDiffers(config, activeConfig);
+    activeConfig = config;
+    hasPendingConfig = false;
+    preferences.putBytes("cfg", &activeConfig, sizeof(NetworkConfig));
+    preferences.remove("cfg_next");
+
+    if (radioChanged) {
+        LoRa.setSpreadingFactor(activeConfig.spreadingFactor);
+        LoRa.setTxPower(activeConfig.txPower);
+        if (LPL_MODE) {
+            LoRa.setPreambleLength(lplPreambleLength(activeConfig.spreadingFactor));
+        }
+    }
+    DEBUG_PRINTF("Config v%u applied\n", activeConfig.version);
+    printLoRaParameters();
+}
+
+// Listens briefly after an uplink for the downlink the gateway may send. Other
+// traffic heard meanwhile is handled as usual.
+void openRxWindow() {
+    if (downlinkReceived) {
+        // Already piggybacked on the end-to-end ACK
+        downlinkReceived = false;
+        return;
+    }
+    unsigned long startTime = millis();
+    unsigned long window = DOWNLINK_RX_WINDOW + MAX_HOPS * (LPL_HOP_DELAY + frameAirtime(sizeof(LoRaMessage)));
+    while (millis() - startTime < window && !downlinkReceived) {
+        int packetSize = LoRa.parsePacket();
+        if (packetSize) {
+            receiveMessage(packetSize);
+        }
+        delay(1);
+    }
+    downlinkReceived = false;
+}
+
+void handleDownlink(const LoRaMessage& msg) {
+    static_assert(sizeof(DownlinkCommand) <= sizeof(msg.payload), "DownlinkCommand must fit in a payload");
+    DownlinkCommand downlink;
+    memcpy(&downlink, msg.payload, sizeof(DownlinkCommand));
+    downlink.command[sizeof(downlink.command) - 1] = '\0';
+
+    downlinkReceived = true;
+    downlinkAckDue = true;
+    if (msg.flags & MSG_FLAG_DL_PENDING) {
+        // Uplink again at the next sample to fetch the rest
+        forceReport = true;
+    }
+    if (hasDownlinkId && downlink.commandId == lastDownlinkId) {
+        DEBUG_PRINTF("Downlink %u repeated, already executed\n", downlink.commandId);
+        return;
+    }
+    lastDownlinkId = downlink.commandId;
+    hasDownlinkId = true;
+    if (preferences.isKey("dl_reboot")) {
+        // The gateway moved on, so it has the confirmation of the REBOOT
+        preferences.remove("dl_reboot");
+    }
+    DEBUG_PRINTF("Downlink %u: %s\n", downlink.commandId, downlink.command);
+    executeCommand(downlink.command);
+}
+
+void executeCommand(const char* command) {
+    if (strcmp(command, "REPORT") == 0) {
+        forceReport = true;
+    } else if (strcmp(command, "REBOOT") == 0) {
+        // Only after the confirmation has gone out. If the gateway misses it
+        // and resends, the ID in NVS marks the command as already run.
+        preferences.putUShort("dl_reboot", lastDownlinkId);
+        rebootPending = true;
+        forceReport = true;
+    } else if (strcmp(command, "RESET_METRICS") == 0) {
+        memset(&metrics, 0, sizeof(metrics));
+        memset(energy.joules, 0, sizeof(energy.joules));
+    } else {
+        DEBUG_PRINTF("Unknown downlink command: %s\n", command);
+    }
+}
+
+void runSleepyCycle() {
+    // The RTC is only read once per second in loop(); here once per wake
+    lastConfigCheck = millis() - CONFIG_CHECK_INTERVAL;
+    checkPendingConfig();
+
+    pollSensors();
+    if (POWER_METER) {
+        samplePowerFeed();
+    }
+
+    if (reportDue() || forceReport) {
+        RoutingEntry route;
+        if (ROUTING_MODE == ROUTING_ON_DEMAND && !findRoute(GATEWAY_ID, route)) {
+            // Saved route expired or was lost: ask once and wait for the answer,
+            // sendMessage() floods if none arrives
+            initiateRouteDiscovery();
+            unsigned long startTime = millis();
+            while (millis() - startTime < SLEEPY_DISCOVERY_WINDOW +
+                   2 * MAX_HOPS * (LPL_HOP_DELAY + frameAirtime(sizeof(LoRaMessage))) &&
+                   !findRoute(GATEWAY_ID, route)) {
+                int packetSize = LoRa.parsePacket();
+                if (packetSize) {
+                    receiveMessage(packetSize);
+                }
+                delay(1);
+            }
+        }
+        sendReport();
+    } else {
+        metrics.reportsSuppressed++;
+    }
+
+    if (POWER_METER) {
+        samplePowerFeed();
+    }
+    updateMetrics();
+    if (millis() - lastDebugTime > activeConfig.debugInterval) {
+        printDebugInfo();
+        DatalogRoutingTables();
+        DatalogNodeStatus();
+        lastDebugTime = millis();
+    }
+
+    goToSleep();
+}
+
+void goToSleep() {
+    // millis() starts after the ROM bootloader, which is not counted
+    unsigned long awakeMs = millis();
+    unsigned long sleepMs = SLEEP_MIN_INTERVAL;
+    if (activeConfig.sampleInterval > awakeMs + SLEEP_MIN_INTERVAL) {
+        sleepMs = activeConfig.sampleInterval - awakeMs;
+    }
+    metrics.wakeCycles++;
+    metrics.lastAwakeMs = awakeMs;
+    metrics.totalAwakeMs += awakeMs;
+    metrics.totalSleepMs += sleepMs;
+    updateEnergy();
+    chargeEnergy(ENERGY_SLEEP, sleepMs / 1000.0, SLEEP_CURRENT_MA);
+    saveSleepState(sleepMs);
+
+    DEBUG_PRINTF("Awake %lu ms, sleeping %lu ms, average current %.3f mA\n",
+                awakeMs, sleepMs, averageCurrent());
+    Serial.flush();
+
+    LoRa.sleep();
+    FastLED.clear(true);
+    esp_sleep_enable_timer_wakeup((uint64_t)sleepMs * 1000ULL);
+    esp_deep_sleep_start();
+}
+
+void saveSleepState(unsigned long sleepMs) {
+    RoutingEntry route;
+    sleepState.valid = true;
+    sleepState.savedAt = millis();
+    sleepState.sleepMs = sleepMs;
+    sleepState.clockBase = clockBase;
+    sleepState.messageCounter = messageCounter;
+    sleepState.seqReservedUntil = seqReservedUntil;
+    sleepState.controlCounter = controlCounter;
+    sleepState.metrics = metrics;
+    sleepState.hasRoute = findRoute(GATEWAY_ID, route);
+    sleepState.hasParentLink = false;
+    if (sleepState.hasRoute) {
+        sleepState.route = route;
+        LinkEstimate* link = findLink(route.nextHopId, false);
+        if (link) {
+            sleepState.parentLink = *link;
+            sleepState.hasParentLink = true;
+        }
+    }
+    memcpy(sleepState.exceptionChannels, exceptionChannels, sizeof(exceptionChannels));
+    memcpy(sleepState.sensorFilters, sensorFilters, sizeof(sensorFilters));
+    sleepState.lastReportTime = lastReportTime;
+    sleepState.hasReported = hasReported;
+    sleepState.lastRouteDiscovery = lastRouteDiscovery;
+    sleepState.lastDebugTime = lastDebugTime;
+    sleepState.lastDownlinkId = lastDownlinkId;
+    sleepState.hasDownlinkId = hasDownlinkId;
+    sleepState.downlinkAckDue = downlinkAckDue;
+    sleepState.rebootPending = rebootPending;
+    sleepState.forceReport = forceReport;
+    sleepState.energy = energy;
+}
+
+void restoreSleepState() {
+    // Moves saved timestamps into this wake's millis(); unsigned wrap-around
+    // keeps every age intact
+    unsigned long shift = sleepState.savedAt + sleepState.sleepMs;
+    clockBase = sleepState.clockBase + shift;
+
+    controlCounter = sleepState.controlCounter;
+    metrics = sleepState.metrics;
+    memcpy(exceptionChannels, sleepState.exceptionChannels, sizeof(exceptionChannels));
+    for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+        exceptionChannels[i].rateBaseTime -= shift;
+    }
+    memcpy(sensorFilters, sleepState.sensorFilters, sizeof(sensorFilters));
+    lastReportTime = sleepState.lastReportTime - shift;
+    hasReported = sleepState.hasReported;
+    lastRouteDiscovery = sleepState.lastRouteDiscovery - shift;
+    lastDebugTime = sleepState.lastDebugTime - shift;
+    lastDownlinkId = sleepState.lastDownlinkId;
+    hasDownlinkId = sleepState.hasDownlinkId;
+    downlinkAckDue = sleepState.downlinkAckDue;
+    rebootPending = sleepState.rebootPending;
+    forceReport = sleepState.forceReport;
+    energy = sleepState.energy;
+
+    if (sleepState.hasRoute) {
+        const RoutingEntry& route = sleepState.route;
+        int slot = insertRouteSlot(GATEWAY_ID, route.pathEtx);
+        if (slot >= 0) {
+            rtNextHop[slot] = route.nextHopId;
+            rtHopCount[slot] = route.hopCount;
+            rtPathEtx[slot] = route.pathEtx;
+            rtLastUpdate[slot] = route.lastUpdate - shift;
+            rtRssi[slot] = route.lastRSSI;
+            rtSnr[slot] = route.lastSNR;
+        }
+    }
+    if (sleepState.hasParentLink) {
+        LinkEstimate* link = findLink(sleepState.parentLink.neighbourId, true);
+        *link = sleepState.parentLink;
+        link->lastHeard -= shift;
+    }
+    DEBUG_PRINTF("Woke after %lu ms, route to gateway %s\n",
+                sleepState.sleepMs, sleepState.hasRoute ? "kept" : "missing");
+}
+
+void samplePowerFeed() {
+    while (meterBus->available() > 0) {
+        String line = meterBus->readStringUntil('\n');
+        int start = 0;
+        for (int i = 0; i < POWER_FEED_CURRENT_FIELD && start >= 0; i++) {
+            start = line.indexOf(',', start);
+            if (start >= 0) {
+                start++;
+            }
+        }
+        if (start < 0) {
+            continue;
+        }
+        float current = line.substring(start).toFloat();
+        if (current > 0) {
+            metrics.awakeCurrentSum += current;
+            metrics.awakeCurrentSamples++;
+            energy.windowMeterSum += current;
+            energy.windowMeterSamples++;
+        }
+    }
+}
+
+float averageCurrent() {
+    if (metrics.awakeCurrentSamples == 0) {
+        return 0;
+    }
+    float awakeCurrent = metrics.awakeCurrentSum / metrics.awakeCurrentSamples;
+    float totalMs = (float)(metrics.totalAwakeMs + metrics.totalSleepMs);
+    if (totalMs == 0) {
+        return awakeCurrent;
+    }
+    return (awakeCurrent * metrics.totalAwakeMs + SLEEP_CURRENT_MA * metrics.totalSleepMs) / totalMs;
+}
+
+long lplPreambleLength(uint8_t spreadingFactor) {
+    // Symbols spanning one check interval
+    return (long)(LPL_CHECK_INTERVAL * (BANDWIDTH / 1000) / (1 << spreadingFactor)) + LPL_PREAMBLE_MARGIN;
+}
+
+int lplListen() {
+    unsigned long elapsed = millis() - lastCadTime;
+    if (elapsed < LPL_CHECK_INTERVAL && (modbus.state == MODBUS_WAITING || samplePending)) {
+        // The sensor buses cannot receive in light sleep
+        return 0;
+    }
+    if (elapsed < LPL_CHECK_INTERVAL) {
+        LoRa.sleep();
+        esp_sleep_enable_timer_wakeup((uint64_t)(LPL_CHECK_INTERVAL - elapsed) * 1000ULL);
+        unsigned long sleepStart = micros();
+        esp_light_sleep_start();
+        unsigned long slept = micros() - sleepStart;
+        energySleptUs += slept;
+        chargeEnergy(ENERGY_SLEEP, slept / 1e6, ENERGY_LIGHT_SLEEP_CURRENT);
+    }
+    lastCadTime = millis();
+    metrics.lplChecks++;
+
+    cadDone = false;
+    cadDetected = false;
+    LoRa.idle();
+    LoRa.channelActivityDetection();
+    unsigned long startTime = millis();
+    while (!cadDone && millis() - startTime < LPL_CAD_TIMEOUT) {
+        delay(1);
+    }
+    if (!cadDetected) {
+        return 0;
+    }
+    metrics.lplWakeups++;
+
+    // Preamble on air: stay in RX until the frame behind it has arrived.
+    // DIO0 is still mapped to CAD done, so parsePacket() sees RX done.
+    unsigned long timeout = LPL_CHECK_INTERVAL +
+        (unsigned long)(LPL_FRAME_SYMBOLS * (1 << activeConfig.spreadingFactor) * 1000 / BANDWIDTH);
+    startTime = millis();
+    while (millis() - startTime < timeout) {
+        int packetSize = LoRa.parsePacket();
+        if (packetSize) {
+            return packetSize;
+        }
+        delay(1);
+    }
+    metrics.lplFalseWakeups++;
+    return 0;
+}
+
+void IRAM_ATTR onCadDone(bool detected) {
+    cadDetected = detected;
+    cadDone = true;
+}
+
+// Time on air in ms of a frame at the active SF (Semtech AN1200.13): explicit
+// header, CR 4/5, CRC counted, low data rate optimisation above 16 ms symbols
+unsigned long frameAirtime(uint8_t bytes) {
+    int sf = activeConfig.spreadingFactor;
+    float symbolMs = (1 << sf) * 1000.0 / BANDWIDTH;
+    int lowDataRate = symbolMs > 16 ? 1 : 0;
+    int bits = 8 * bytes - 4 * sf + 28 + 16;
+    int payloadSymbols = 8;
+    if (bits > 0) {
+        int divisor = 4 * (sf - 2 * lowDataRate);
+        payloadSymbols += (bits + divisor - 1) / divisor * 5;
+    }
+    return (unsigned long)((LORA_PREAMBLE_LENGTH + 4.25 + payloadSymbols) * symbolMs) + 1;
+}
+
+bool transmitPacket() {
+    // endPacket() blocks until TX done, so this is the airtime
+    unsigned long startTime = micros();
+    bool sent = LoRa.endPacket();
+    unsigned long airtime = micros() - startTime;
+    energyTxUs += airtime;
+    chargeEnergy(ENERGY_TX, airtime / 1e6, txCurrent(activeConfig.txPower));
+    return sent;
+}
+
+float txCurrent(int8_t txPower) {
+    // PA_BOOST fit through the SX1276 datasheet points, 87 mA at 17 dBm and
+    // 120 mA at 20 dBm
+    return 54.0 + 0.66 * pow(10, txPower / 10.0);
+}
+
+void pollSensors() {
+    unsigned long since = millis();
+    modbusRefreshWait();
+    // The sensor streamed on while we slept, wait for a frame from this wake
+    unsigned long startTime = millis();
+    while (!distanceCurrent() && millis() - startTime < DISTANCE_TIMEOUT) {
+        parseDistance();
+        delay(1);
+    }
+    sampleSensors(since);
+}
+
+float filterReading(SensorFilter& filter, float reading, bool ok) {
+    if (!ok) {
+        filter.failed++;
+        filter.quality = QUALITY_STALE;
+        return filter.value;
+    }
+    if (filter.count > 0 && filter.spikeLimit > 0 && fabs(reading - filter.value) > filter.spikeLimit) {
+        if (filter.spikes == 0 || fabs(reading - filter.spikeCandidate) > filter.spikeLimit) {
+            // Scattered outliers do not add up to a step
+            filter.spikeCandidate = reading;
+            filter.spikes = 0;
+        }
+        if (++filter.spikes < FILTER_SPIKE_CONFIRM) {
+            filter.rejected++;
+            filter.quality = QUALITY_SPIKE;
+            return filter.value;
+        }
+        // The level really moved, start over from here
+        filter.count = 0;
+    }
+    filter.spikes = 0;
+    filter.quality = 0;
+
+    filter.window[filter.next] = reading;
+    filter.next = (filter.next + 1) % FILTER_MEDIAN;
+    if (filter.count < FILTER_MEDIAN) {
+        filter.count++;
+    }
+    // Sort the readings accepted since the last restart
+    float sorted[FILTER_MEDIAN];
+    for (uint8_t i = 0; i < filter.count; i++) {
+        float value = filter.window[(filter.next + FILTER_MEDIAN - 1 - i) % FILTER_MEDIAN];
+        uint8_t j = i;
+        while (j > 0 && sorted[j - 1] > value) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+    float median = sorted[filter.count / 2];
+
+    if (filter.count == 1) {
+        filter.value = median;
+    } else {
+        filter.value += filter.emaAlpha * (median - filter.value);
+    }
+    return filter.value;
+}
+
+void sampleSensors(unsigned long since) {
+    for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+        float reading = sensorValues[i];
+        bool ok = sensorReads[i](reading, since);
+        sensorValues[i] = filterReading(sensorFilters[i], reading, ok);
+    }
+}
+
+void printSensors(File& file) {
+    // "Rain: 1.00 mm, Distance: 2.00 cm, "
+    for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+        file.print(sensorFields[i].name);
+        file.print(": ");
+        file.print(sensorValues[i], sensorFields[i].decimals);
+        file.print(" ");
+        file.print(sensorFields[i].unit);
+        file.print(", ");
+    }
+}
+
+Stream* beginSensorBus(int uart, SoftwareSerial& fallback, int8_t rxPin, int8_t txPin, unsigned long baud) {
+    if (uart == SENSOR_UART_SOFTWARE) {
+        fallback.begin(baud);
+        return &fallback;
+    }
+    HardwareSerial& port = sensorUart(uart);
+    port.setRxBufferSize(SENSOR_RX_BUFFER);  // only takes effect before begin()
+    port.begin(baud, SERIAL_8N1, rxPin, txPin);
+    return &port;
+}
+
+HardwareSerial& sensorUart(int uart) {
+    return uart == 1 ? Serial1 : Serial2;
+}
+
+void onModbusRxIdle() {
+    // Runs in the UART event task once the line has been idle for MODBUS_RX_TIMEOUT
+    modbusRxIdle = true;
+}
+
+void beginSerialProfile() {
+    // 80 MHz APB / 80 = 1 us per count, restarted by every alarm
+    profileTimer = timerBegin(PROFILE_TIMER, 80, true);
+    timerAttachInterrupt(profileTimer, &onProfileTimer, true);
+    timerAlarmWrite(profileTimer, PROFILE_PERIOD, true);
+    timerAlarmEnable(profileTimer);
+}
+
+void IRAM_ATTR onProfileTimer() {
+    uint32_t latency = (uint32_t)timerRead(profileTimer);
+    serialProfile.latencySum += latency;
+    if (latency > serialProfile.latencyMax) {
+        serialProfile.latencyMax = latency;
+    }
+    serialProfile.interrupts++;
+}
+
+void profileSpin() {
+    uint32_t start = ESP.getCycleCount();
+    for (volatile uint16_t i = 0; i < PROFILE_SPIN; i++) {
+    }
+    uint32_t cycles = ESP.getCycleCount() - start;
+    if (serialProfile.spinMin == 0 || cycles < serialProfile.spinMin) {
+        serialProfile.spinMin = cycles;
+    }
+    serialProfile.spinCycles += cycles;
+    serialProfile.spins++;
+}
+
+float profileLatency() {
+    if (serialProfile.interrupts == 0) {
+        return 0;
+    }
+    return (float)serialProfile.latencySum / serialProfile.interrupts;
+}
+
+float profileLoad() {
+    // Percent of the busy loop's time spent outside it
+    if (serialProfile.spinCycles == 0) {
+        return 0;
+    }
+    return 100.0 * (1.0 - (double)serialProfile.spinMin * serialProfile.spins / serialProfile.spinCycles);
+}
+
+void chargeEnergy(uint8_t category, double seconds, float currentMa) {
+    double joules = ENERGY_SUPPLY_VOLTAGE * currentMa / 1000.0 * seconds;
+    if (category != ENERGY_SLEEP) {
+        energy.windowModelJ += joules;
+        joules *= energy.calibration;
+    }
+    energy.joules[category] += joules;
+}
+
+void updateEnergy() {
+    // Awake time since the last call; the radio listens whenever it is not
+    // transmitting
+    unsigned long now = micros();
+    unsigned long awakeUs = now - energyCheckpoint - energySleptUs;
+    unsigned long rxUs = awakeUs > energyTxUs ? awakeUs - energyTxUs : 0;
+    energyCheckpoint = now;
+    energyTxUs = 0;
+    energySleptUs = 0;
+    chargeEnergy(ENERGY_CPU, awakeUs / 1e6, ENERGY_CPU_CURRENT);
+    chargeEnergy(ENERGY_RX, rxUs / 1e6, ENERGY_RX_CURRENT);
+    energy.windowAwakeMs += awakeUs / 1000;
+
+    if (energy.windowAwakeMs < ENERGY_CALIBRATION_WINDOW) {
+        return;
+    }
+    if (energy.windowMeterSamples >= ENERGY_CALIBRATION_SAMPLES && energy.windowModelJ > 0) {
+        float measuredMa = energy.windowMeterSum / energy.windowMeterSamples;
+        float modelMa = energy.windowModelJ / ENERGY_SUPPLY_VOLTAGE / (energy.windowAwakeMs / 1000.0) * 1000.0;
+        float ratio = constrain(measuredMa / modelMa, 0.2f, 5.0f);
+        energy.calibration += ENERGY_CALIBRATION_ALPHA * (ratio - energy.calibration);
+        DEBUG_PRINTF("Energy model %.2f mA, meter %.2f mA, calibration %.2f\n",
+                    modelMa, measuredMa, energy.calibration);
+    }
+    energy.windowModelJ = 0;
+    energy.windowAwakeMs = 0;
+    energy.windowMeterSum = 0;
+    energy.windowMeterSamples = 0;
+}
@@ -8,7 +8,9 @@
 #include <SD.h>
 #include <Wire.h>
 #include <FastLED.h>
+#include <mbedtls/md.h>
 #include <Arduino.h>
+#include "sensor_schema.h"
 
 // Debug configuration
 #define DEBUG_MODE true           
@@ -65,14 +67,69 @@ const int CS = 5;
 #define SYNC_WORD      0x12     
 
 // Node Configuration
-#define NODE_ID        0           
-#define GATEWAY_ID     0      
+#define NODE_ID        0        // 0 on the devkit gateway, 255 on the TTGO gateway
+// Both gateways answer the anycast address the end nodes send uplinks to.
+// Each ACKs what it hears; before upload the two are deduplicated by sequence
+// number using the peer's ACKs overheard on air.
+#define GATEWAY_PRIMARY_ID   0
+#define GATEWAY_SECONDARY_ID 255
+#define GATEWAY_ID     0xFD     // anycast uplink address
+#define GATEWAY_PEER_ID ((NODE_ID) == GATEWAY_PRIMARY_ID ? GATEWAY_SECONDARY_ID : GATEWAY_PRIMARY_ID)
+#define MAX_HOPS       3
+#define BROADCAST_ID   0xFE     // 0xFF is taken by the TTGO gateway (node-id-255)
+#define ROUTE_TIMEOUT  300000   // 5 minutes
 
 // Message Types
 #define MSG_TYPE_DATA 1
 #define MSG_TYPE_ROUTE_REQUEST 2
 #define MSG_TYPE_ROUTE_RESPONSE 3
 #define MSG_TYPE_ACK 4
+#define MSG_TYPE_BEACON 5
+#define MSG_TYPE_LINK_ACK 6
+#define MSG_TYPE_CONFIG 7
+#define MSG_TYPE_DOWNLINK 8
+
+// Unicast DATA is acknowledged hop by hop with a LinkAck; the end-to-end ACK
+// is only sent when the source set MSG_FLAG_CONFIRM
+#define MSG_FLAG_CONFIRM 0x01
+#define MSG_FLAG_DOWNLINK 0x02      // ACK payload carries a DownlinkCommand
+#define MSG_FLAG_DL_PENDING 0x04    // more downlinks queued for the node
+#define MSG_FLAG_DL_ACK 0x08        // uplink confirms the last downlink
+#define MSG_FLAG_RETRY_MASK 0xF0    // end-to-end retry count, ignored here
+
+// Routing mode, must match the end nodes. In proactive mode the gateway roots
+// the distance vector by beaconing cost 0; in convergecast mode it roots the
+// rank gradient with trickle-paced beacons of rank 0.
+#define ROUTING_ON_DEMAND 0
+#define ROUTING_PROACTIVE 1
+#define ROUTING_CONVERGECAST 2
+#define ROUTING_MODE ROUTING_ON_DEMAND
+#define BEACON_INTERVAL 30000   // 30 seconds
+#define BEACON_JITTER 3000      // up to 3 seconds
+#define ROUTE_COST_INFINITE 0xFF
+unsigned long lastBeaconTime = 0;
+unsigned long nextBeaconDelay = 0;
+uint8_t beaconCounter = 0;
+
+// Trickle timing (convergecast mode), same constants as the end nodes
+#define TRICKLE_IMIN 4000               // 4 seconds
+#define TRICKLE_IMAX_DOUBLINGS 6        // up to 256 seconds
+#define TRICKLE_IMAX ((unsigned long)TRICKLE_IMIN << TRICKLE_IMAX_DOUBLINGS)
+#define TRICKLE_REDUNDANCY 2
+unsigned long trickleInterval = TRICKLE_IMIN;
+unsigned long trickleStart = 0;
+unsigned long trickleFireAt = 0;
+uint8_t trickleHeard = 0;
+bool trickleFired = false;
+
+// Low-power listening, must match the end nodes. Relays only sample the
+// channel every LPL_CHECK_INTERVAL, so every frame goes out with a preamble
+// spanning the interval. The gateway itself listens continuously; the long
+// receive preamble setting still accepts normal-length frames.
+#define LPL_MODE false
+#define LPL_CHECK_INTERVAL 1000         // ms between CAD samples on the relays
+#define LPL_PREAMBLE_MARGIN 16          // symbols
+#define LORA_PREAMBLE_LENGTH 8          // library default
 
 // WiFi and Web Configuration
 // Konfigurasi WiFi melalui file SD Card
@@ -85,6 +142,9 @@ const char* WIFI_PASSWORD = "h4los3mu4";    // Ganti dengan password WiFi Anda
 // URL API untuk POST
 const char* serverName = "https://misred-iot.com/api/projects/6/values";
 const char* authToken = "01J8D7YTYJ3FQ8RG7MVBSFMHW5";
+// Datastreams are numbered node by node in sensor_schema.h order, so node n,
+// sensor i goes to FIRST_DATASTREAM + (n - 1) * SENSOR_COUNT + i
+#define FIRST_DATASTREAM 11
 unsigned long previousMillisWeb = 0;
 const int webInterval = 25000;
 
@@ -94,23 +154,166 @@ bool inisiasi = false;
 bool koneksi = false;
 bool sd_isi = false;
 
-// Data Variables untuk 4 node
-float node1_value1, node1_value2;
-float node2_value1, node2_value2;
-float node3_value1, node3_value2;
-float node4_value1, node4_value2;
-uint8_t messageCounter = 0;
+// Node freshness tracking
+// End nodes report by exception, so the last value is held until the node's
+// heartbeat (H: field, seconds) is overdue by STALE_GRACE_FACTOR.
+#define NUM_NODES 4
+#define DEFAULT_HEARTBEAT_INTERVAL 300000   // 5 minutes
+#define STALE_GRACE_FACTOR 2.5
+struct NodeStatus {
+    unsigned long lastSeen;
+    unsigned long heartbeatInterval;
+    bool hasData;
+    uint16_t lastSeq;          // sequence number of the held reading
+    uint16_t peerAckedSeq;     // newest uplink the peer gateway was heard ACKing
+    bool peerAcked;
+    uint16_t configVersion;    // V reported in the node's telemetry
+    uint32_t quality;          // Q of the held reading, 0 = all values fresh
+};
+NodeStatus nodeStatus[NUM_NODES + 1] = {};
+
+// Data Variables per node, indexed by SensorId (sensor_schema.h)
+float nodeValues[NUM_NODES + 1][SENSOR_COUNT];
+
+// Per-source receive windows
+// Tracks the last SEQ_WINDOW_SIZE data sequence numbers of each node to count
+// duplicates, reordering and gaps. A jump back larger than the window means
+// the node lost its sequence state, so the window is restarted.
+#define SEQ_WINDOW_SIZE 32
+struct SequenceWindow {
+    uint16_t highestSeq;
+    uint32_t receivedMask;    // bit i set: highestSeq - i was received
+    bool initialized;
+    unsigned long received;
+    unsigned long duplicates;
+    unsigned long reordered;
+    unsigned long lost;
+    unsigned long resyncs;
+};
+SequenceWindow seqWindows[NUM_NODES + 1] = {};
+
+// Reverse routes back to each node, learned from route requests and data.
+// ACKs and route responses are unicast to nextHopId instead of broadcast.
+struct ReverseRoute {
+    uint8_t nextHopId;
+    uint8_t hopCount;
+    uint8_t pathCost;        // ETX x10 as reported by the arriving frame
+    uint8_t answeredCost;    // pathCost of the last route request answered
+    unsigned long lastUpdate;
+    bool valid;
+};
+ReverseRoute reverseRoutes[NUM_NODES + 1] = {};
+uint16_t controlCounter = 0;
+
+// Over-the-air configuration push
+// /CONFIG.txt on the SD card holds one line:
+//   version,applyAt,sampleIntervalMs,debugIntervalMs,spreadingFactor,txPower[,target]
+// applyAt is the RTC unix time at which nodes and gateway switch (0 = on
+// receipt). A config that changes the SF or TX power needs a future applyAt,
+// and is rejected with 0. The signed config is flooded every
+// CONFIG_PUSH_INTERVAL on the current radio settings until each node that
+// reports data shows that version in its telemetry, or until applyAt for a
+// radio change. target defaults to all nodes.
+// The HMAC key shared with the nodes is the first line of CONFIG_KEY_FILE on
+// the SD card; without it nothing is pushed.
+#define CONFIG_KEY_FILE "/CONFIGKEY.txt"
+#define CONFIG_KEY_MAX 64
+#define CONFIG_SIGNATURE_SIZE 8
+#define CONFIG_CHECK_INTERVAL 1000      // ms between RTC reads for applyAt
+#define CONFIG_PUSH_INTERVAL 60000      // 60 seconds
+struct NetworkConfig {
+    uint16_t version;
+    uint8_t target;                      // node ID or BROADCAST_ID
+    uint8_t spreadingFactor;
+    int8_t txPower;
+    uint32_t applyAt;
+    uint32_t sampleInterval;             // ms
+    uint32_t debugInterval;              // ms
+    uint8_t signature[CONFIG_SIGNATURE_SIZE];   // truncated HMAC-SHA256 of the fields above
+} __attribute__((packed));
+char configKey[CONFIG_KEY_MAX + 1] = "";
+NetworkConfig networkConfig;
+bool hasNetworkConfig = false;
+bool networkConfigApplied = false;
+bool configPushed = false;
+unsigned long lastConfigCheck = 0;
+unsigned long lastConfigPush = 0;
 
 // Message Structure
 struct LoRaMessage {
     uint8_t messageType;   
     uint8_t sourceId;
     uint8_t destinationId;
+    uint8_t senderId;      // node that transmitted this hop
+    uint8_t nextHopId;     // node that should take this hop, BROADCAST_ID to flood
     uint8_t hopCount;      
-    uint8_t messageId;
+    uint8_t pathCost;      // ETX x10 accumulated from sourceId to senderId
+    uint8_t flags;         // MSG_FLAG_*
+    uint16_t messageId;    // per-source sequence number
     char payload[32];
 } __attribute__((packed));
 
+// Payload of MSG_TYPE_DOWNLINK frames and of ACKs with MSG_FLAG_DOWNLINK
+struct DownlinkCommand {
+    uint16_t commandId;
+    char command[30];
+} __attribute__((packed));
+
+// Downlink queues (Class-A style)
+// Commands typed on the serial console as "DL <node> <command>" wait here
+// until the node's next uplink. The head is sent right after that uplink's
+// ACK (inside it when the node asked for an end-to-end ACK) and stays queued
+// until a later uplink carries MSG_FLAG_DL_ACK.
+#define DOWNLINK_QUEUE_DEPTH 4
+struct DownlinkQueue {
+    DownlinkCommand commands[DOWNLINK_QUEUE_DEPTH];
+    uint8_t head;
+    uint8_t count;
+    bool inFlight;           // head was sent and awaits confirmation
+};
+DownlinkQueue downlinkQueues[NUM_NODES + 1] = {};
+uint16_t downlinkCounter = 0;
+
+// Hop-by-hop acknowledgement of a unicast DATA frame
+struct LinkAck {
+    uint8_t messageType;   // MSG_TYPE_LINK_ACK
+    uint8_t senderId;      // node that took the frame
+    uint8_t receiverId;    // node that transmitted it
+    uint8_t sourceId;      // originator of the frame
+    uint16_t messageId;
+} __attribute__((packed));
+
+// Compact distance-vector beacon (proactive mode)
+struct RouteBeacon {
+    uint8_t messageType;   // MSG_TYPE_BEACON
+    uint8_t senderId;
+    uint8_t hops;          // hops to the gateway
+    uint8_t cost;          // path ETX x10 to the gateway, ROUTE_COST_INFINITE if none
+    uint8_t beaconId;
+} __attribute__((packed));
+
+// Performance metrics
+struct PerformanceMetrics {
+    unsigned long messagesReceived;
+    unsigned long dedupHits;
+    unsigned long dedupMisses;
+} metrics = {0};
+
+// Duplicate suppression
+// Fixed-size ring of recently seen (sourceId, messageId, type) keys. Entries
+// older than DEDUP_TIMEOUT are ignored so a wrapped messageId is not mistaken
+// for a duplicate.
+#define DEDUP_CACHE_SIZE 32
+#define DEDUP_TIMEOUT 60000  // 60 seconds
+struct DedupEntry {
+    uint8_t sourceId;
+    uint16_t messageId;
+    uint8_t messageType;   // 0 marks an empty slot
+    unsigned long timestamp;
+};
+DedupEntry dedupCache[DEDUP_CACHE_SIZE] = {};
+uint8_t dedupNext = 0;
+
 // Function Declarations
 // Function Declarations
 void parseCredentialsAndConnect(const String &input);
@@ -120,12 +323,42 @@ bool initLoRa();
 void blinkLED0(CRGB color, int count, int delayMs);
 void ledFunction();
 void Datalog();
-void parsePayload(const char* payload, float* rain_val, float* distance_val);
+unsigned long parseHeartbeat(const char* payload, unsigned long previous);
+uint16_t parseConfigVersion(const char* payload, uint16_t previous);
+uint32_t parseQuality(const char* payload);
+void loadNetworkConfig();
+void signConfig(const NetworkConfig& config, uint8_t* signature);
+void sendConfig();
+void checkNetworkConfig();
+bool isNodeStale(uint8_t nodeId);
+void notePeerAck(uint8_t nodeId, uint16_t seq);
+bool peerUploads(uint8_t nodeId);
 void receiveMessage(int packetSize);
-void sendAck(uint8_t messageId, uint8_t destinationId);  // Tambahkan ini
+void sendAck(uint16_t messageId, uint8_t destinationId);  // Tambahkan ini
+void sendLinkAck(const LoRaMessage& msg);
+bool queueDownlink(uint8_t nodeId, const char* command);
+bool attachDownlink(LoRaMessage& msg);
+void sendDownlink(uint8_t nodeId);
+void confirmDownlink(uint8_t nodeId);
+void checkSerialCommands();
+void sendRouteResponse(uint8_t destinationId);
+void sendBeacon();
+void receiveBeacon();
+void trickleStartInterval();
+void trickleReset();
+void runTrickle();
+void updateReverseRoute(uint8_t nodeId, uint8_t nextHopId, uint8_t hopCount, uint8_t pathCost);
+uint8_t reverseNextHop(uint8_t nodeId);
+bool isDuplicate(const LoRaMessage& msg);
+bool trackSequence(uint8_t sourceId, uint16_t seq);
+void printSequenceStats();
+void DatalogSequenceStats();
 void connectToWiFiDirect();
 void printLoRaParameters();
 void resetLoRa();
+uint8_t activeSpreadingFactor();
+int activeTxPower();
+long lplPreambleLength();
 
 void setup() {
     Serial.begin(115200);
@@ -145,6 +378,7 @@ void setup() {
         return;
     }
     //*/
+    loadNetworkConfig();
 
     // Initialize LoRa
     if (!initLoRa()) {
@@ -156,6 +390,9 @@ void setup() {
     }
     
     printLoRaParameters();
+    if (ROUTING_MODE == ROUTING_CONVERGECAST) {
+        trickleStartInterval();
+    }
 
     ///
     // Check WiFi credentials from SD card
@@ -188,6 +425,14 @@ void loop() {
     if (packetSize) {
         receiveMessage(packetSize);
     }
+
+    if (ROUTING_MODE == ROUTING_PROACTIVE && millis() - lastBeaconTime > nextBeaconDelay) {
+        sendBeacon();
+    } else if (ROUTING_MODE == ROUTING_CONVERGECAST) {
+        runTrickle();
+    }
+    checkNetworkConfig();
+    checkSerialCommands();
     
     // Check if it's time to send data to web server
     unsigned long currentMillis = millis();
@@ -196,6 +441,8 @@ void loop() {
         blinkLED0(CRGB::Blue, 3, 50);
         sendDataToWeb();
         Datalog();
+        printSequenceStats();
+        DatalogSequenceStats();
         previousMillisWeb = currentMillis;
     }
 }
@@ -224,6 +471,23 @@ void connectToWiFiDirect() {
 }
 
 void receiveMessage(int packetSize) {
+    if (packetSize == sizeof(RouteBeacon)) {
+        receiveBeacon();
+        return;
+    }
+    if (packetSize == sizeof(LinkAck)) {
+        // Only the peer gateway's link ACKs matter: it holds that uplink
+        LinkAck linkAck;
+        LoRa.readBytes((uint8_t*)&linkAck, sizeof(LinkAck));
+        if (linkAck.messageType == MSG_TYPE_LINK_ACK && linkAck.senderId == GATEWAY_PEER_ID) {
+            notePeerAck(linkAck.sourceId, linkAck.messageId);
+        }
+        return;
+    }
+    if (packetSize != sizeof(LoRaMessage)) {
+        DEBUG_PRINTF("Invalid packet size: %d bytes\n", packetSize);
+        return;
+    }
     if (packetSize > 0) {
         LoRaMessage msg;
         int bytesRead = LoRa.readBytes((uint8_t*)&msg, sizeof(LoRaMessage));
@@ -232,47 +496,208 @@ void receiveMessage(int packetSize) {
         DEBUG_PRINTF("Message Type: %d, Source: %d, Destination: %d, Message ID: %d\n",
                     msg.messageType, msg.sourceId, msg.destinationId, msg.messageId);
         DEBUG_PRINTF("RSSI: %d, SNR: %.2f\n", LoRa.packetRssi(), LoRa.packetSnr());
+
+        // The peer gateway's ACKs, whoever relays them, tell us what it took
+        if (msg.messageType == MSG_TYPE_ACK && msg.sourceId == GATEWAY_PEER_ID) {
+            notePeerAck(msg.destinationId, msg.messageId);
+            return;
+        }
+
+        // Frames unicast to another relay are not for us
+        if (msg.nextHopId != NODE_ID && msg.nextHopId != BROADCAST_ID) {
+            return;
+        }
+        updateReverseRoute(msg.sourceId, msg.senderId, msg.hopCount + 1, msg.pathCost);
+
+        bool forUs = msg.destinationId == GATEWAY_ID || msg.destinationId == NODE_ID;
+        if (msg.messageType == MSG_TYPE_ROUTE_REQUEST && forUs) {
+            // Each flooded copy arrives over its own relay: answer the first,
+            // then only copies that found a strictly cheaper path
+            bool known = msg.sourceId >= 1 && msg.sourceId <= NUM_NODES;
+            bool duplicate = isDuplicate(msg);
+            if (duplicate && (!known || msg.pathCost >= reverseRoutes[msg.sourceId].answeredCost)) {
+                DEBUG_PRINTF("Duplicate route request from Node %d via %d dropped\n", msg.sourceId, msg.senderId);
+                return;
+            }
+            if (known) {
+                reverseRoutes[msg.sourceId].answeredCost = msg.pathCost;
+            }
+            DEBUG_PRINTF("Route request from Node %d via %d, sending response\n", msg.sourceId, msg.senderId);
+            sendRouteResponse(msg.sourceId);
+            return;
+        }
         
-        if (msg.messageType == MSG_TYPE_DATA && msg.destinationId == GATEWAY_ID) {
+        if (msg.messageType == MSG_TYPE_DATA && forUs) {
             // Send ACK immediately before any other processing
             DEBUG_PRINTLN("Valid data message received, sending ACK...");
-            sendAck(msg.messageId, msg.sourceId);
+            if (msg.nextHopId == NODE_ID) {
+                sendLinkAck(msg);
+            }
+            if (msg.flags & MSG_FLAG_DL_ACK) {
+                confirmDownlink(msg.sourceId);
+            }
+            // A queued downlink rides in the end-to-end ACK, or follows the
+            // link ACK while the node's RX window is open
+            if (msg.flags & MSG_FLAG_CONFIRM) {
+                sendAck(msg.messageId, msg.sourceId);
+            } else {
+                sendDownlink(msg.sourceId);
+            }
+
+            // Retries after a lost ACK are re-ACKed above but not recorded twice
+            bool windowDuplicate = trackSequence(msg.sourceId, msg.messageId);
+            if (isDuplicate(msg) || windowDuplicate) {
+                DEBUG_PRINTF("Duplicate data from Node %d (ID: %d) ignored, hits/misses: %lu/%lu\n",
+                            msg.sourceId, msg.messageId, metrics.dedupHits, metrics.dedupMisses);
+                return;
+            }
+            metrics.messagesReceived++;
             
             // Parse data berdasarkan source ID
-            float val1, val2;
-            parsePayload(msg.payload, &val1, &val2);
-            
+            float values[SENSOR_COUNT] = {};
+            decodeSensors(msg.payload, values);
+
             // Simpan data sesuai dengan node pengirim
-            switch(msg.sourceId) {
-                case 1:
-                    node1_value1 = val1;
-                    node1_value2 = val2;
-                    break;
-                case 2:
-                    node2_value1 = val1;
-                    node2_value2 = val2;
-                    break;
-                case 3:
-                    node3_value1 = val1;
-                    node3_value2 = val2;
-                    break;
-                case 4:
-                    node4_value1 = val1;
-                    node4_value2 = val2;
-                    break;
+            if (msg.sourceId >= 1 && msg.sourceId <= NUM_NODES) {
+                memcpy(nodeValues[msg.sourceId], values, sizeof(values));
+                NodeStatus& status = nodeStatus[msg.sourceId];
+                status.lastSeen = millis();
+                status.heartbeatInterval = parseHeartbeat(msg.payload,
+                    status.hasData ? status.heartbeatInterval : DEFAULT_HEARTBEAT_INTERVAL);
+                status.configVersion = parseConfigVersion(msg.payload, status.configVersion);
+                status.quality = parseQuality(msg.payload);
+                status.hasData = true;
+                status.lastSeq = msg.messageId;
             }
             
             DEBUG_PRINTLN("=== Data received ===");
             DEBUG_PRINTF("From Node: %d\n", msg.sourceId);
             DEBUG_PRINTF("Raw payload: %s\n", msg.payload);
-            DEBUG_PRINTF("Value 1: %.2f\n", val1);
-            DEBUG_PRINTF("Value 2: %.2f\n", val2);
+            for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+                DEBUG_PRINTF("%s: %.*f %s\n", sensorFields[i].name, sensorFields[i].decimals,
+                            values[i], sensorFields[i].unit);
+            }
+            if (parseQuality(msg.payload)) {
+                DEBUG_PRINTF("Quality: 0x%lX\n", (unsigned long)parseQuality(msg.payload));
+            }
             DEBUG_PRINTLN("==================");
         }
     }
 }
 
-void sendAck(uint8_t messageId, uint8_t destinationId) {
+bool queueDownlink(uint8_t nodeId, const char* command) {
+    if (nodeId < 1 || nodeId > NUM_NODES) {
+        return false;
+    }
+    DownlinkQueue& queue = downlinkQueues[nodeId];
+    if (queue.count >= DOWNLINK_QUEUE_DEPTH) {
+        return false;
+    }
+    DownlinkCommand& slot = queue.commands[(queue.head + queue.count) % DOWNLINK_QUEUE_DEPTH];
+    slot.commandId = ++downlinkCounter;
+    strncpy(slot.command, command, sizeof(slot.command) - 1);
+    slot.command[sizeof(slot.command) - 1] = '\0';
+    queue.count++;
+    return true;
+}
+
+// Copies the head of the node's queue into msg; true if there was one
+bool attachDownlink(LoRaMessage& msg) {
+    if (msg.destinationId < 1 || msg.destinationId > NUM_NODES) {
+        return false;
+    }
+    DownlinkQueue& queue = downlinkQueues[msg.destinationId];
+    if (queue.count == 0) {
+        return false;
+    }
+    memcpy(msg.payload, &queue.commands[queue.head], sizeof(DownlinkCommand));
+    msg.flags |= MSG_FLAG_DOWNLINK;
+    if (queue.count > 1) {
+        msg.flags |= MSG_FLAG_DL_PENDING;
+    }
+    queue.inFlight = true;
+    DEBUG_PRINTF("Downlink %u to Node %d: %s\n", queue.commands[queue.head].commandId,
+                msg.destinationId, queue.commands[queue.head].command);
+    return true;
+}
+
+void sendDownlink(uint8_t nodeId) {
+    LoRaMessage msg;
+    memset(&msg, 0, sizeof(LoRaMessage));
+    msg.messageType = MSG_TYPE_DOWNLINK;
+    msg.sourceId = NODE_ID;
+    msg.destinationId = nodeId;
+    msg.senderId = NODE_ID;
+    msg.nextHopId = reverseNextHop(nodeId);
+    msg.messageId = controlCounter++;
+    if (!attachDownlink(msg)) {
+        return;
+    }
+
+    LoRa.beginPacket();
+    LoRa.write((uint8_t*)&msg, sizeof(LoRaMessage));
+    LoRa.endPacket();
+}
+
+void confirmDownlink(uint8_t nodeId) {
+    if (nodeId < 1 || nodeId > NUM_NODES) {
+        return;
+    }
+    DownlinkQueue& queue = downlinkQueues[nodeId];
+    if (!queue.inFlight || queue.count == 0) {
+        return;
+    }
+    DEBUG_PRINTF("Downlink %u confirmed by Node %d\n", queue.commands[queue.head].commandId, nodeId);
+    queue.head = (queue.head + 1) % DOWNLINK_QUEUE_DEPTH;
+    queue.count--;
+    queue.inFlight = false;
+}
+
+// Serial console: "DL <node> <command>" queues a downlink
+void checkSerialCommands() {
+    if (!Serial.available()) {
+        return;
+    }
+    String line = Serial.readStringUntil('\n');
+    line.trim();
+    if (!line.startsWith("DL ")) {
+        return;
+    }
+    int split = line.indexOf(' ', 3);
+    if (split < 0) {
+        DEBUG_PRINTLN("Usage: DL <node> <command>");
+        return;
+    }
+    uint8_t nodeId = line.substring(3, split).toInt();
+    String command = line.substring(split + 1);
+    if (queueDownlink(nodeId, command.c_str())) {
+        DEBUG_PRINTF("Downlink queued for Node %d: %s\n", nodeId, command.c_str());
+    } else {
+        DEBUG_PRINTF("Downlink queue for Node %d full or node unknown\n", nodeId);
+    }
+}
+
+void sendLinkAck(const LoRaMessage& msg) {
+    LinkAck linkAck;
+    linkAck.messageType = MSG_TYPE_LINK_ACK;
+    linkAck.senderId = NODE_ID;
+    linkAck.receiverId = msg.senderId;
+    linkAck.sourceId = msg.sourceId;
+    linkAck.messageId = msg.messageId;
+
+    if (LPL_MODE) {
+        // The sender is awake and waiting, skip the wake-up preamble
+        LoRa.setPreambleLength(LORA_PREAMBLE_LENGTH);
+    }
+    LoRa.beginPacket();
+    LoRa.write((uint8_t*)&linkAck, sizeof(LinkAck));
+    LoRa.endPacket();
+    if (LPL_MODE) {
+        LoRa.setPreambleLength(lplPreambleLength());
+    }
+}
+
+void sendAck(uint16_t messageId, uint8_t destinationId) {
     DEBUG_PRINTF("Preparing ACK for messageId: %d to destination: %d\n", messageId, destinationId);
     
     LoRaMessage ack;
@@ -280,9 +705,13 @@ void sendAck(uint8_t messageId, uint8_t destinationId) {
     ack.messageType = MSG_TYPE_ACK;       // Pastikan ini 4
     ack.sourceId = NODE_ID;
     ack.destinationId = destinationId;
+    ack.senderId = NODE_ID;
+    ack.nextHopId = reverseNextHop(destinationId);
     ack.messageId = messageId;
     ack.hopCount = 0;                     // Tambahkan ini
+    ack.pathCost = 0;
     memset(ack.payload, 0, sizeof(ack.payload)); // Clear payload
+    attachDownlink(ack);
     
     LoRa.beginPacket();
     LoRa.write((uint8_t*)&ack, sizeof(LoRaMessage));
@@ -297,18 +726,379 @@ void sendAck(uint8_t messageId, uint8_t destinationId) {
     }
 }
 
-void parsePayload(const char* payload, float* rain_val, float* distance_val) {
-    char* ptr = strstr(payload, "R:");
-    if (ptr) {
-        *rain_val = atof(ptr + 2);
+bool isDuplicate(const LoRaMessage& msg) {
+    unsigned long now = millis();
+    for (int i = 0; i < DEDUP_CACHE_SIZE; i++) {
+        const DedupEntry& entry = dedupCache[i];
+        if (entry.messageType == msg.messageType &&
+            entry.sourceId == msg.sourceId &&
+            entry.messageId == msg.messageId &&
+            now - entry.timestamp < DEDUP_TIMEOUT) {
+            metrics.dedupHits++;
+            return true;
+        }
     }
+
+    // Miss: remember this key, overwriting the oldest slot
+    dedupCache[dedupNext].sourceId = msg.sourceId;
+    dedupCache[dedupNext].messageId = msg.messageId;
+    dedupCache[dedupNext].messageType = msg.messageType;
+    dedupCache[dedupNext].timestamp = now;
+    dedupNext = (dedupNext + 1) % DEDUP_CACHE_SIZE;
+    metrics.dedupMisses++;
+    return false;
+}
+
+void sendRouteResponse(uint8_t destinationId) {
+    LoRaMessage routeResp;
+    memset(&routeResp, 0, sizeof(LoRaMessage));
+    routeResp.messageType = MSG_TYPE_ROUTE_RESPONSE;
+    routeResp.sourceId = NODE_ID;
+    routeResp.destinationId = destinationId;
+    routeResp.senderId = NODE_ID;
+    routeResp.nextHopId = reverseNextHop(destinationId);
+    routeResp.hopCount = 0;
+    routeResp.messageId = controlCounter++;
     
-    ptr = strstr(payload, "D:");
+    LoRa.beginPacket();
+    LoRa.write((uint8_t*)&routeResp, sizeof(LoRaMessage));
+    LoRa.endPacket();
+}
+
+void sendBeacon() {
+    RouteBeacon beacon;
+    beacon.messageType = MSG_TYPE_BEACON;
+    beacon.senderId = NODE_ID;
+    beacon.hops = 0;
+    beacon.cost = 0;
+    beacon.beaconId = beaconCounter++;
+
+    LoRa.beginPacket();
+    LoRa.write((uint8_t*)&beacon, sizeof(RouteBeacon));
+    LoRa.endPacket();
+
+    lastBeaconTime = millis();
+    nextBeaconDelay = BEACON_INTERVAL + random(0, BEACON_JITTER);
+}
+
+// Relay beacons only matter to the trickle timer: a ranked neighbour counts
+// as a consistent beacon, an orphaned one asks for our rank soon
+void receiveBeacon() {
+    RouteBeacon beacon;
+    LoRa.readBytes((uint8_t*)&beacon, sizeof(RouteBeacon));
+    if (ROUTING_MODE != ROUTING_CONVERGECAST || beacon.messageType != MSG_TYPE_BEACON) {
+        return;
+    }
+    if (beacon.cost == ROUTE_COST_INFINITE || beacon.hops >= MAX_HOPS) {
+        trickleReset();
+    } else {
+        trickleHeard++;
+    }
+}
+
+// Starts a trickle interval with the transmit point in its second half
+void trickleStartInterval() {
+    trickleStart = millis();
+    trickleFireAt = trickleInterval / 2 + random(0, trickleInterval / 2);
+    trickleHeard = 0;
+    trickleFired = false;
+}
+
+void trickleReset() {
+    if (trickleInterval == TRICKLE_IMIN) {
+        return;
+    }
+    trickleInterval = TRICKLE_IMIN;
+    trickleStartInterval();
+}
+
+void runTrickle() {
+    unsigned long elapsed = millis() - trickleStart;
+    if (!trickleFired && elapsed >= trickleFireAt) {
+        trickleFired = true;
+        if (trickleHeard < TRICKLE_REDUNDANCY) {
+            sendBeacon();
+        }
+    }
+    if (elapsed >= trickleInterval) {
+        if (trickleInterval < TRICKLE_IMAX) {
+            trickleInterval *= 2;
+        }
+        trickleStartInterval();
+    }
+}
+
+// Keep the lowest-ETX fresh path; the current next hop always refreshes.
+// pathCost covers source to the last relay, which is all the gateway can
+// compare since it does not estimate its own links.
+void updateReverseRoute(uint8_t nodeId, uint8_t nextHopId, uint8_t hopCount, uint8_t pathCost) {
+    if (nodeId < 1 || nodeId > NUM_NODES || hopCount > MAX_HOPS + 1) {
+        return;
+    }
+    ReverseRoute& route = reverseRoutes[nodeId];
+    bool expired = millis() - route.lastUpdate >= ROUTE_TIMEOUT;
+    if (!route.valid || expired || nextHopId == route.nextHopId || pathCost < route.pathCost) {
+        if (!route.valid || nextHopId != route.nextHopId) {
+            DEBUG_PRINTF("Reverse route to Node %d via %d (%d hops)\n", nodeId, nextHopId, hopCount);
+        }
+        route.nextHopId = nextHopId;
+        route.hopCount = hopCount;
+        route.pathCost = pathCost;
+        route.lastUpdate = millis();
+        route.valid = true;
+    }
+}
+
+uint8_t reverseNextHop(uint8_t nodeId) {
+    if (nodeId >= 1 && nodeId <= NUM_NODES) {
+        const ReverseRoute& route = reverseRoutes[nodeId];
+        if (route.valid && millis() - route.lastUpdate < ROUTE_TIMEOUT) {
+            return route.nextHopId;
+        }
+    }
+    return BROADCAST_ID;
+}
+
+// Returns true if seq was already received from this source
+bool trackSequence(uint8_t sourceId, uint16_t seq) {
+    if (sourceId < 1 || sourceId > NUM_NODES) {
+        return false;
+    }
+    SequenceWindow& window = seqWindows[sourceId];
+
+    if (!window.initialized) {
+        window.highestSeq = seq;
+        window.receivedMask = 1;
+        window.initialized = true;
+        window.received++;
+        return false;
+    }
+
+    // Signed distance handles the 16-bit wrap
+    int16_t diff = (int16_t)(seq - window.highestSeq);
+
+    if (diff > 0) {
+        // Everything skipped over is missing until it shows up late
+        window.lost += diff - 1;
+        window.receivedMask = (diff < SEQ_WINDOW_SIZE) ? (window.receivedMask << diff) | 1 : 1;
+        window.highestSeq = seq;
+        window.received++;
+        return false;
+    }
+
+    uint16_t offset = -diff;
+    if (offset >= SEQ_WINDOW_SIZE) {
+        DEBUG_PRINTF("Node %d sequence jumped back %u, resyncing window\n", sourceId, offset);
+        window.highestSeq = seq;
+        window.receivedMask = 1;
+        window.resyncs++;
+        window.received++;
+        return false;
+    }
+
+    uint32_t bit = (uint32_t)1 << offset;
+    if (window.receivedMask & bit) {
+        window.duplicates++;
+        return true;
+    }
+
+    window.receivedMask |= bit;
+    window.reordered++;
+    if (window.lost > 0) {
+        window.lost--;
+    }
+    window.received++;
+    return false;
+}
+
+void printSequenceStats() {
+    DEBUG_PRINTLN("\n=== Sequence Stats ===");
+    DEBUG_PRINTLN("Node\tLastSeq\tRecv\tDup\tReord\tLost\tResync");
+    for (uint8_t node = 1; node <= NUM_NODES; node++) {
+        const SequenceWindow& window = seqWindows[node];
+        DEBUG_PRINTF("%d\t%u\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+            node, window.highestSeq, window.received, window.duplicates,
+            window.reordered, window.lost, window.resyncs);
+    }
+    DEBUG_PRINTLN("==================");
+}
+
+// H and V are left out of a full payload, the previous value then stands
+uint16_t parseConfigVersion(const char* payload, uint16_t previous) {
+    const char* ptr = strstr(payload, "V:");
+    return ptr ? (uint16_t)strtoul(ptr + 2, NULL, 10) : previous;
+}
+
+// Q is only sent when the node held a value: 2 bits per sensor in SensorId
+// order, 0x1 stale read and 0x2 rejected spike
+uint32_t parseQuality(const char* payload) {
+    const char* ptr = strstr(payload, "Q:");
+    return ptr ? (uint32_t)strtoul(ptr + 2, NULL, 16) : 0;
+}
+
+void loadNetworkConfig() {
+    File configFile = SD.open("/CONFIG.txt");
+    if (!configFile) {
+        return;
+    }
+    File keyFile = SD.open(CONFIG_KEY_FILE);
+    if (keyFile) {
+        String key = keyFile.readStringUntil('\n');
+        keyFile.close();
+        key.trim();
+        if (key.length() <= CONFIG_KEY_MAX) {
+            strcpy(configKey, key.c_str());
+        }
+    }
+    if (configKey[0] == '\0') {
+        configFile.close();
+        DEBUG_PRINTLN(CONFIG_KEY_FILE " missing or invalid, no config push");
+        return;
+    }
+    String line = configFile.readStringUntil('\n');
+    configFile.close();
+
+    unsigned int version, spreadingFactor, target = BROADCAST_ID;
+    unsigned long applyAt, sampleInterval, debugInterval;
+    int txPower;
+    int fields = sscanf(line.c_str(), "%u,%lu,%lu,%lu,%u,%d,%u", &version, &applyAt,
+                        &sampleInterval, &debugInterval, &spreadingFactor, &txPower, &target);
+    if (fields < 6) {
+        DEBUG_PRINTLN("CONFIG.txt malformed, no config push");
+        return;
+    }
+    if (applyAt == 0 && (spreadingFactor != SPREADING_FACTOR || txPower != TX_POWER)) {
+        // Nodes would switch one by one as the flood reaches them
+        DEBUG_PRINTLN("CONFIG.txt changes the radio without applyAt, no config push");
+        return;
+    }
+
+    memset(&networkConfig, 0, sizeof(NetworkConfig));
+    networkConfig.version = version;
+    networkConfig.target = target;
+    networkConfig.spreadingFactor = spreadingFactor;
+    networkConfig.txPower = txPower;
+    networkConfig.applyAt = applyAt;
+    networkConfig.sampleInterval = sampleInterval;
+    networkConfig.debugInterval = debugInterval;
+    signConfig(networkConfig, networkConfig.signature);
+    hasNetworkConfig = true;
+    DEBUG_PRINTF("Config v%u loaded: SF%u, %d dBm, sample %lu ms, applies at %lu\n",
+                version, spreadingFactor, txPower, sampleInterval, applyAt);
+}
+
+void signConfig(const NetworkConfig& config, uint8_t* signature) {
+    uint8_t mac[32];
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                    (const uint8_t*)configKey, strlen(configKey),
+                    (const uint8_t*)&config, offsetof(NetworkConfig, signature), mac);
+    memcpy(signature, mac, CONFIG_SIGNATURE_SIZE);
+}
+
+void sendConfig() {
+    static_assert(sizeof(NetworkConfig) <= sizeof(((LoRaMessage*)0)->payload), "NetworkConfig must fit in a payload");
+    LoRaMessage msg;
+    memset(&msg, 0, sizeof(LoRaMessage));
+    msg.messageType = MSG_TYPE_CONFIG;
+    msg.sourceId = NODE_ID;
+    msg.destinationId = networkConfig.target;
+    msg.senderId = NODE_ID;
+    msg.nextHopId = BROADCAST_ID;
+    msg.messageId = controlCounter++;
+    memcpy(msg.payload, &networkConfig, sizeof(NetworkConfig));
+
+    LoRa.beginPacket();
+    LoRa.write((uint8_t*)&msg, sizeof(LoRaMessage));
+    LoRa.endPacket();
+    DEBUG_PRINTF("Config v%u pushed to %d\n", networkConfig.version, networkConfig.target);
+}
+
+// Re-floods the config while any reporting node is still on an older
+// version, then switches the gateway radio at applyAt. Pushes go out on the
+// radio settings the nodes are still using; once a radio change is applied a
+// node that missed it cannot hear them, and falls back on its own.
+void checkNetworkConfig() {
+    if (!hasNetworkConfig || millis() - lastConfigCheck < CONFIG_CHECK_INTERVAL) {
+        return;
+    }
+    lastConfigCheck = millis();
+    bool radioChange = networkConfig.spreadingFactor != SPREADING_FACTOR || networkConfig.txPower != TX_POWER;
+
+    if (!(networkConfigApplied && radioChange) &&
+        (!configPushed || millis() - lastConfigPush >= CONFIG_PUSH_INTERVAL)) {
+        bool outdated = !configPushed;
+        for (uint8_t node = 1; node <= NUM_NODES; node++) {
+            bool targeted = networkConfig.target == BROADCAST_ID || networkConfig.target == node;
+            if (targeted && nodeStatus[node].hasData && nodeStatus[node].configVersion < networkConfig.version) {
+                outdated = true;
+            }
+        }
+        if (outdated) {
+            sendConfig();
+        }
+        configPushed = true;
+        lastConfigPush = millis();
+    }
+
+    if (!networkConfigApplied &&
+        (networkConfig.applyAt == 0 || myRTC.now().unixtime() >= networkConfig.applyAt)) {
+        LoRa.setSpreadingFactor(networkConfig.spreadingFactor);
+        LoRa.setTxPower(networkConfig.txPower);
+        networkConfigApplied = true;
+        if (LPL_MODE) {
+            LoRa.setPreambleLength(lplPreambleLength());
+        }
+        DEBUG_PRINTF("Config v%u applied: SF%d, %d dBm\n",
+                    networkConfig.version, networkConfig.spreadingFactor, networkConfig.txPower);
+        printLoRaParameters();
+    }
+}
+
+unsigned long parseHeartbeat(const char* payload, unsigned long previous) {
+    const char* ptr = strstr(payload, "H:");
     if (ptr) {
-        *distance_val = atof(ptr + 2);
+        unsigned long seconds = strtoul(ptr + 2, NULL, 10);
+        if (seconds > 0) {
+            return seconds * 1000;
+        }
+    }
+    return previous;
+}
+
+void notePeerAck(uint8_t nodeId, uint16_t seq) {
+    if (nodeId < 1 || nodeId > NUM_NODES) {
+        return;
+    }
+    NodeStatus& status = nodeStatus[nodeId];
+    if (!status.peerAcked || (int16_t)(seq - status.peerAckedSeq) > 0) {
+        status.peerAckedSeq = seq;
+        status.peerAcked = true;
     }
 }
 
+// True when the peer gateway holds a newer reading of this node, or the same
+// one and the peer is the primary. The held reading is then left to the peer
+// so the server receives each uplink once.
+bool peerUploads(uint8_t nodeId) {
+    const NodeStatus& status = nodeStatus[nodeId];
+    if (!status.peerAcked) {
+        return false;
+    }
+    int16_t ahead = (int16_t)(status.peerAckedSeq - status.lastSeq);
+    return ahead > 0 || (ahead == 0 && GATEWAY_PEER_ID == GATEWAY_PRIMARY_ID);
+}
+
+bool isNodeStale(uint8_t nodeId) {
+    if (nodeId < 1 || nodeId > NUM_NODES) {
+        return true;
+    }
+    const NodeStatus& status = nodeStatus[nodeId];
+    if (!status.hasData) {
+        return true;
+    }
+    return millis() - status.lastSeen > (unsigned long)(status.heartbeatInterval * STALE_GRACE_FACTOR);
+}
+
 void parseCredentialsAndConnect(const String &input) {
     int firstDelimiter = input.indexOf('n');
     int secondDelimiter = input.indexOf("xx");  // Gunakan string instead of char
@@ -349,15 +1139,39 @@ void sendDataToWeb() {
         http.addHeader("Content-Type", "application/json");
         http.addHeader("X-Auth-Token", authToken);
         
-        // Create JSON payload for 8 data streams (2 data per node × 4 nodes)
+        // Create JSON payload, one data stream per sensor per node
+        // Stale nodes are left out so held values are not re-published as fresh
+        String streams = "";
+        String streamValues = "";
+        for (uint8_t node = 1; node <= NUM_NODES; node++) {
+            if (isNodeStale(node)) {
+                DEBUG_PRINTF("Node %d stale, skipping upload\n", node);
+                continue;
+            }
+            if (peerUploads(node)) {
+                DEBUG_PRINTF("Node %d reading held by gateway %d, skipping upload\n", node, GATEWAY_PEER_ID);
+                continue;
+            }
+            int firstStream = FIRST_DATASTREAM + (node - 1) * SENSOR_COUNT;
+            for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+                if (streams.length() > 0) {
+                    streams += ", ";
+                    streamValues += ", ";
+                }
+                streams += String(firstStream + i);
+                streamValues += String(nodeValues[node][i], (unsigned int)sensorFields[i].decimals);
+            }
+        }
+
+        if (streams.length() == 0) {
+            DEBUG_PRINTLN("All nodes stale, nothing to upload");
+            http.end();
+            return;
+        }
+
         String jsonPayload = "{";
-        jsonPayload += "\"datastreams\": [11, 12, 13, 14, 15, 16, 17, 18],";
-        jsonPayload += "\"values\": [";
-        jsonPayload += String(node1_value1) + ", " + String(node1_value2) + ", ";
-        jsonPayload += String(node2_value1) + ", " + String(node2_value2) + ", ";
-        jsonPayload += String(node3_value1) + ", " + String(node3_value2) + ", ";
-        jsonPayload += String(node4_value1) + ", " + String(node4_value2);
-        jsonPayload += "]}";
+        jsonPayload += "\"datastreams\": [" + streams + "],";
+        jsonPayload += "\"values\": [" + streamValues + "]}";
         
         DEBUG_PRINTLN("Sending payload: " + jsonPayload);
         
@@ -403,27 +1217,71 @@ void Datalog() {
         myFile10.print(", ");
         
         // Log data from all nodes
-        myFile10.print("Node1: ");
-        myFile10.print(node1_value1);
-        myFile10.print(", ");
-        myFile10.print(node1_value2);
-        myFile10.print(" | Node2: ");
-        myFile10.print(node2_value1);
-        myFile10.print(", ");
-        myFile10.print(node2_value2);
-        myFile10.print(" | Node3: ");
-        myFile10.print(node3_value1);
-        myFile10.print(", ");
-        myFile10.print(node3_value2);
-        myFile10.print(" | Node4: ");
-        myFile10.print(node4_value1);
-        myFile10.print(", ");
-        myFile10.println(node4_value2);
+        for (uint8_t node = 1; node <= NUM_NODES; node++) {
+            myFile10.print(node == 1 ? "Node" : " | Node");
+            myFile10.print(node);
+            myFile10.print(": ");
+            for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+                if (i > 0) {
+                    myFile10.print(", ");
+                }
+                myFile10.print(nodeValues[node][i], sensorFields[i].decimals);
+            }
+        }
+
+        // Flag nodes whose heartbeat is overdue
+        myFile10.print(" | Stale:");
+        for (uint8_t node = 1; node <= NUM_NODES; node++) {
+            if (isNodeStale(node)) {
+                myFile10.print(" ");
+                myFile10.print(node);
+            }
+        }
+        myFile10.print(" | Config:");
+        for (uint8_t node = 1; node <= NUM_NODES; node++) {
+            myFile10.print(" ");
+            myFile10.print(node);
+            myFile10.print(":v");
+            myFile10.print(nodeStatus[node].configVersion);
+        }
+        myFile10.print(" | Quality:");
+        for (uint8_t node = 1; node <= NUM_NODES; node++) {
+            if (nodeStatus[node].quality) {
+                myFile10.print(" ");
+                myFile10.print(node);
+                myFile10.print(":0x");
+                myFile10.print(nodeStatus[node].quality, HEX);
+            }
+        }
+        myFile10.println();
         
         myFile10.close();
     }
 }
 
+void DatalogSequenceStats() {
+    DateTime now = myRTC.now();
+    String getMonthStr = now.getMonth() < 10 ? "0" + String(now.getMonth()) : String(now.getMonth());
+    String getDayStr = now.getDay() < 10 ? "0" + String(now.getDay()) : String(now.getDay());
+    String namaFile = getDayStr + getMonthStr + String(now.getYear(), DEC);
+    
+    File myFile10 = SD.open("/datalog/" + namaFile + "_sequence.txt", FILE_APPEND);
+    if (myFile10) {
+        myFile10.printf("%d-%d-%d %d:%d:%d\n",
+                        now.getYear(), now.getMonth(), now.getDay(),
+                        now.getHour(), now.getMinute(), now.getSecond());
+        myFile10.println("Node\tLastSeq\tRecv\tDup\tReord\tLost\tResync");
+        for (uint8_t node = 1; node <= NUM_NODES; node++) {
+            const SequenceWindow& window = seqWindows[node];
+            myFile10.printf("%d\t%u\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+                node, window.highestSeq, window.received, window.duplicates,
+                window.reordered, window.lost, window.resyncs);
+        }
+        myFile10.println();
+        myFile10.close();
+    }
+}
+
 void blinkLED0(CRGB color, int times, int delayTime) {
     for (int i = 0; i < times; i++) {
         leds[0] = color;
@@ -456,10 +1314,11 @@ bool initLoRa() {
         return false;
     }
     
-    LoRa.setSpreadingFactor(SPREADING_FACTOR);
+    LoRa.setSpreadingFactor(activeSpreadingFactor());
     LoRa.setSignalBandwidth(BANDWIDTH);
-    LoRa.setTxPower(TX_POWER);
+    LoRa.setTxPower(activeTxPower());
     LoRa.setSyncWord(SYNC_WORD);
+    LoRa.setPreambleLength(LPL_MODE ? lplPreambleLength() : LORA_PREAMBLE_LENGTH);
     
     DEBUG_PRINTLN("LoRa.begin() successful.");
     DEBUG_PRINTLN("LoRa settings applied.");
@@ -471,12 +1330,27 @@ void printLoRaParameters() {
     DEBUG_PRINTLN("\n=== LoRa Parameters (Gateway) ===");
     DEBUG_PRINTF("Frequency: %.2f MHz\n", FREQUENCY/1E6);
     DEBUG_PRINTF("Bandwidth: %.2f kHz\n", BANDWIDTH/1E3);
-    DEBUG_PRINTF("Spreading Factor: %d\n", SPREADING_FACTOR);
-    DEBUG_PRINTF("TX Power: %d dBm\n", TX_POWER);
+    DEBUG_PRINTF("Spreading Factor: %d\n", activeSpreadingFactor());
+    DEBUG_PRINTF("TX Power: %d dBm\n", activeTxPower());
     DEBUG_PRINTF("Sync Word: 0x%02X\n", SYNC_WORD);
+    DEBUG_PRINTF("Config Version: %u\n", networkConfigApplied ? networkConfig.version : 0);
     DEBUG_PRINTLN("=====================");
 }
 
+// Radio settings in use: the applied network config, else the defines
+uint8_t activeSpreadingFactor() {
+    return networkConfigApplied ? networkConfig.spreadingFactor : SPREADING_FACTOR;
+}
+
+int activeTxPower() {
+    return networkConfigApplied ? networkConfig.txPower : TX_POWER;
+}
+
+long lplPreambleLength() {
+    // Symbols spanning one check interval at the spreading factor in use
+    return (long)(LPL_CHECK_INTERVAL * (BANDWIDTH / 1000) / (1 << activeSpreadingFactor())) + LPL_PREAMBLE_MARGIN;
+}
+
 void resetLoRa() {
     DEBUG_PRINTLN("Resetting LoRa module...");
     digitalWrite(LORA_RST, LOW);